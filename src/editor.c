@@ -1,16 +1,47 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <time.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <math.h>
+#include <regex.h>
+#include <malloc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define BUFFADD 250
+#define GAP 64
+#define BLOCK 65536
+#define CHUNK 1024
 #define MEM_ERROR -1
 #define NEWBUF {NULL, 0, 0}
+#define COM_EXIT 1
+#define MATCH_LITERAL 0
+#define MATCH_REGEX 1
+#define SORT_NUMERIC 1
+#define SORT_REVERSE 2
 
 typedef struct buffer
 {
@@ -19,26 +50,48 @@ typedef struct buffer
   int mem;
 } buffer;
 
+/* per thread, render() counts the growth done by its own thread */
+_Thread_local long buf_allocs = 0;
+
+int reserve(buffer *buf, int need)
+{
+  char *tmp = NULL;
+  int mem;
+
+  if (need <= buf->mem) return 0;
+
+  mem = buf->mem < BUFFADD ? BUFFADD : buf->mem * 2;
+  if (mem < need) mem = need;
+
+  tmp = (char*)realloc(buf->chars, mem);
+  if (tmp == NULL) return MEM_ERROR;
+
+  buf->chars = tmp;
+  buf->mem = mem;
+  buf_allocs++;
+  return 0;
+}
+
 int append(buffer *buf, char* s, int l)
 {
-  int i;
+  if (l == 169)
+    l = strnlen(s, l);
 
-  
-  for (i = 0; i < l; i++)
-  {
-    if (l == 169 && s[i] == '\0')
-      break;
+  if (reserve(buf, buf->len + l) == MEM_ERROR) return MEM_ERROR;
 
-    buf->len++;
-    if (buf->len > buf->mem)
-    {
-      buf->mem += BUFFADD;
-      buf->chars = (char*)realloc(buf->chars, buf->mem);
-      if (buf->chars == NULL) return MEM_ERROR;
-    }
+  memcpy(&buf->chars[buf->len], s, l);
+  buf->len += l;
 
-    buf->chars[buf->len - 1] = s[i];
-  }
+  return 0;
+}
+
+int fill(buffer *buf, char c, int n)
+{
+  if (n <= 0) return 0;
+  if (reserve(buf, buf->len + n) == MEM_ERROR) return MEM_ERROR;
+
+  memset(&buf->chars[buf->len], c, n);
+  buf->len += n;
 
   return 0;
 }
@@ -94,7 +147,165 @@ void freear(struct arraystr *ar)
   ar->num = 0;
 }
 
-struct arraystr ahelp;
+/* what stats counts in some lines, see STATISTICS. at is the longest
+   line, counted from the first of them */
+struct tally
+{
+  long lines;
+  long bytes;
+  long words;
+  long tabs;
+  int longest;
+  int at;
+};
+
+/* a file opened through its index, see INDEX: chunks read from it
+   until they change hold it open */
+struct source
+{
+  int refs;
+  int fd;
+  int lost;
+  dev_t dev;
+  ino_t ino;
+  struct source *next;
+};
+
+/* a text keeps its line descriptors in chunks of up to CHUNK, count in
+   each; the table has where every chunk starts (see chunk_of). A snapshot
+   shares the table and the chunks, the writer copies what it touches
+   first. A chunk with a src has its lines at at in that file, rawlen
+   bytes. sum is its tally while summed */
+struct chunk
+{
+  atomic_int refs;
+  atomic_int packed;
+  atomic_long used;
+  long bytes;
+  int dense;
+  int count;
+  int rawlen;
+  int size;
+  char *blob;
+  off_t off;
+  struct source *src;
+  off_t at;
+  int summed;
+  struct tally sum;
+  str *lines;
+};
+
+/* cold chunks are kept compressed, see COMPRESSION, and out in a page
+   file, see PAGING. tick counts commands, a chunk remembers the tick it
+   was last read at. budget is what -m gives every document */
+struct packer
+{
+  pthread_mutex_t lock;
+  atomic_long tick;
+  long budget;
+  int fd;
+  off_t end;
+  int spilled;
+  atomic_long loose;
+  atomic_long grown;
+} K = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+/* the files chunks are read from, under K.lock. index is what -i gives
+   every document */
+struct sources
+{
+  struct source *list;
+  int index;
+} X;
+
+/* storage shared by identical lines, see INTERNING */
+struct atom
+{
+  char *chars;
+  int length;
+  int refs;
+  uint32_t hash;
+  long seen;
+  struct atom *next;
+  struct atom *anext;
+};
+
+/* the atoms hashed by content and by the address of their chars, mem
+   buckets each. num is read without the lock to skip lookups while
+   nothing is interned */
+struct interner
+{
+  pthread_mutex_t lock;
+  atomic_int num;
+  int mem;
+  long seen;
+  struct atom **text;
+  struct atom **addr;
+} A = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* start[k] is the first line of chunk k, start[n] the number of lines */
+struct table
+{
+  atomic_int refs;
+  int n;
+  int mem;
+  struct chunk **chunks;
+  int *start;
+};
+
+struct text
+{
+  struct table *tab;
+  int num;
+  long epoch;
+};
+
+/* line storage a snapshot may still read: freed once every snapshot
+   taken before it was retired is dropped */
+struct retired
+{
+  char *chars;
+  long stamp;
+};
+
+struct reclaim
+{
+  pthread_mutex_t lock;
+  long now;
+  long *live;
+  int nlive;
+  int mlive;
+  struct retired *list;
+  int nlist;
+  int mlist;
+} Z = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+struct text ahelp;
+
+/* block buffered input, handed out a line at a time */
+struct reader
+{
+  int fd;
+  char *buf;
+  int pos;
+  int len;
+  int mem;
+  int eof;
+};
+
+/* tokens of the commands read so far; the arena is reset, not freed,
+   before each interactive command */
+struct tokenizer
+{
+  struct reader in;
+  buffer chars;
+  str *tokens;
+  int *offs;
+  int num;
+  int mem;
+  int lines;
+  int more;
+};
 
 
 
@@ -109,16 +320,220 @@ struct config
   int blank;
   int printing;
   int saved;
+  long gen;
+  long budget;
+  int intern;
+  int index;
+  int tty;
   struct termios orig_termios;
   struct termios raw;
 };
 
-struct config E;
-struct arraystr T;
+struct renderstats
+{
+  long frames;
+  long allocs;
+};
+
+struct range
+{
+  int start;
+  int end;
+};
+
+struct insertion
+{
+  int pos;
+  int seq;
+  struct arraystr text;
+};
+
+/* edits queued between begin and commit */
+struct batch
+{
+  int active;
+  int base;
+  struct insertion *ins;
+  int nins;
+  int mins;
+  struct range *del;
+  int ndel;
+  int mdel;
+};
+
+/* background save: writes a snapshot of the text taken at write */
+struct saver
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int pending;
+  int threaded;
+  int done;
+  int result;
+  int fd;
+  char *filename;
+  char *target;
+  char *tmpname;
+  struct text snap;
+  long gen;
+  long written;
+  long total;
+};
+
+/* the file given on the command line is read on a helper thread; lines it
+   has read wait in ready until the main thread moves them into T */
+struct loader
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int active;
+  int done;
+  int cancel;
+  int result;
+  int fd;
+  long size;
+  long bytes;
+  long budget;
+  long rbytes;
+  struct arraystr ready;
+  int mready;
+};
+
+/* follow: the file the text was read from, watched for what is
+   appended to it. size is how much of it the text holds */
+struct follower
+{
+  int active;
+  int fd;
+  int watch;
+  int wfile;
+  off_t size;
+  uint64_t tail;
+  long reread;
+};
+
+/* the line last edited a character at a time, held with a hole of
+   end - start bytes at start so that typing on at the same place only
+   fills the hole. While it is open the line in the text is stale,
+   execute closes it before a command that is not such an edit */
+struct gap
+{
+  char *chars;
+  int line;
+  int start;
+  int end;
+  int mem;
+};
+
+/* a macro: the line edits made between record and stop, kept parsed.
+   line and end count from base, the first line the macro edited */
+#define STEP_EDIT 0
+#define STEP_SYMBOL 1
+#define STEP_STRING 2
+#define STEP_REPLACE 3
+
+struct step
+{
+  int op;
+  int line;
+  int end;
+  int pos;
+  char c;
+  str text;
+  str find;
+};
+
+struct macro
+{
+  int active;
+  int base;
+  struct step *steps;
+  int num;
+  int mem;
+};
+
+/* set while commands come from a script file (-s) */
+struct script
+{
+  char *name;
+  int line;
+  int keep_going;
+  int verbose;
+  int reported;
+};
+
+/* the last sort or uniq, see SORTING */
+struct undo
+{
+  long gen;
+  int start;
+  int count;
+  str *before;
+  int num;
+  struct arraystr dropped;
+};
+
+/* everything that belongs to one text. The editor has one, a server
+   (-l) one per hosted file and connection; a thread works on the
+   document D points to, helpers it starts inherit it */
+struct document
+{
+  pthread_mutex_t lock;
+  char *key;
+  int users;
+  struct config config;
+  struct text text;
+  struct batch batch;
+  struct saver saver;
+  struct loader loader;
+  struct undo undo;
+  struct follower follow;
+  struct gap gap;
+  struct macro macro;
+};
+
+struct document main_doc = {
+  .saver.lock = PTHREAD_MUTEX_INITIALIZER,
+  .loader.lock = PTHREAD_MUTEX_INITIALIZER,
+  .loader.cond = PTHREAD_COND_INITIALIZER
+};
+_Thread_local struct document *D = &main_doc;
+
+/* the documents open in the editor, main_doc is buffer 1 */
+struct buffers
+{
+  struct document **docs;
+  int num;
+  int mem;
+} F;
+
+#define E (D->config)
+#define T (D->text)
+#define B (D->batch)
+#define W (D->saver)
+#define L (D->loader)
+#define U (D->undo)
+#define O (D->follow)
+#define G (D->gap)
+#define M (D->macro)
+
 struct pagesInfo I;
+struct renderstats R;
+_Thread_local struct script S;
+
+/* where commands print: stdout, or the reply being built for a client */
+_Thread_local FILE *out = NULL;
+
+/* frame arena: every page() renders into this one buffer, which is sized
+   from the window and only grows when the window does */
+buffer frame = NEWBUF;
+
+volatile sig_atomic_t winch = 0;
 
 /* functions */
 int init();
+int init_tty();
 
 int init_modes();
 int enable_raw_mode();
@@ -129,286 +544,852 @@ void sighandler(int sig);
 void set_name(char *filename);
 int e_read(char *filename);
 int e_open(char *filename);
+int e_open_async(char *filename);
+void load_take();
+void load_until(int n);
+void load_cancel();
 int e_write(char *filename);
+int save_collect();
+void save_wait();
+void line_free(char *chars);
+int line_own(str *line);
+void release(struct arraystr *ar);
+void save_status();
+
+str *line_at(struct text *t, int j);
+void squeeze(struct text *t);
+void squeeze_grown(struct text *t);
+int chunk_spill(struct chunk *c);
+int chunk_fetch(struct chunk *c);
+void spill_free(struct chunk *c);
+int index_open(char *filename, struct text *out, off_t *size);
+int source_read(struct chunk *c);
+void source_drop(struct source *src);
+int source_busy(char *filename);
+int follow_start();
+int follow_take(int force);
+void follow_stop();
+void follow_mark(off_t size);
+uint64_t line_hash(str line);
+int print_follow();
+void tail_page();
+int line_intern(str *line);
+int text_intern(struct text *t, int from, int to);
+void intern_stats(long bytes);
+void e_stats(int start, int end);
+str *line_mut(struct text *t, int j);
+int text_splice(struct text *t, int pos, int del, str *in, int nin);
+int text_flat(struct text *t, int from, int to, struct arraystr *out);
+int text_insert(struct text *t, int pos, struct arraystr *in);
+void text_release(struct text *t);
 
 void set_wrap(int k);
 void set_numbers(int k);
 void set_tabwidth(int k);
 
-int print(int start, int end, struct arraystr *ar);
+int print(int start, int end, struct text *txt);
+int dump(int start, int end, struct text *txt);
 
-int e_insert_after(str toin, int pos, struct arraystr *ar);
+int e_insert_after(str toin, int pos, struct text *t);
+int e_insert_file(char *filename, int pos);
+int e_insert_buffer(int n, int pos);
+int insert_lines(struct arraystr *text, int pos);
 int e_replace_substr(int start, int end, str tofind, str toreplace);
-int e_insert_symbol(str *line, char c, int pos);
-int e_edit(str *line, char c, int pos);
+int gap_close();
+int gap_length(int j);
+int e_insert_symbol(int j, char c, int pos);
+int e_insert_string(int j, str s, int pos);
+int e_edit(int j, char c, int pos);
 int e_delr(int start, int end);
+int e_dellines(struct range *ranges, int n);
+int delete_lines(struct arraystr *ar, int from);
 int e_delcom(int mode);
+int e_filter(int start, int end, str pattern, int mode, int keep);
+int macro_compile(struct arraystr *ar, struct step *st);
+int macro_add(struct step *st);
+void macro_drop();
+int e_replay(int start, int end);
+int e_pipe(int start, int end, char *command);
+int e_sort(int start, int end, int flags);
+int e_uniq(int start, int end);
+int e_diff(char *filename);
+int e_undo();
+void undo_drop();
+int e_begin();
+int e_commit();
+int e_rollback();
+int batch_queue(int pos, struct arraystr *text);
+int batch_insert(str toin, int pos);
+int batch_delete(int start, int end);
 void e_help();
 void e_exit();
 
 int split(struct arraystr *ar, str s);
-int read_command(struct arraystr *ar);
+int spawn_helper(pthread_t *thread, void *(*fn)(void*), void *arg);
+int tokenizer_init(struct tokenizer *tk, int fd);
+void tokenizer_free(struct tokenizer *tk);
+void tokens_reset(struct tokenizer *tk);
+int read_command(struct tokenizer *tk, struct arraystr *ar);
+int execute(struct arraystr *ar);
+int run_script(char *name, char *filename);
+int run_server(char *path);
+
+struct document *doc_new(char *key);
+void doc_free(struct document *d);
+int buffer_add(struct document *d);
+int e_buffer_open(char *filename);
+int e_buffer_switch(int n);
+void e_buffer_list();
+void buffers_wait();
+int buffers_unsaved();
+void buffers_free();
+
+FILE *output()
+{
+  return out != NULL ? out : stdout;
+}
+
+void msg(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  if (S.name != NULL)
+  {
+    if (S.line > 0)
+      fprintf(stderr, "%s:%d: ", S.name, S.line);
+    else
+      fprintf(stderr, "%s: ", S.name);
+    vfprintf(stderr, fmt, args);
+    S.reported = 1;
+  }
+  else
+    vfprintf(output(), fmt, args);
+  va_end(args);
+}
+
+int err_com()
+{
+  msg("invalid command\n");
+  return -1;
+}
 
-void err_com()
+/* line X of the text exists */
+int line_ok(int x)
 {
-  printf("invalid command\n");
+  if (x < 1 || x > T.num)
+  {
+    msg("out of bounds\n");
+    return 0;
+  }
+  return 1;
 }
 
 
 int main(int argc, char **argv)
 {
+  int opt;
+  char *script = NULL;
+  char *sock = NULL;
+  int res;
+
+  while ((opt = getopt(argc, argv, "s:kvl:m:i")) != -1)
+  {
+    if (opt == 's')
+      script = optarg;
+    else if (opt == 'm' && atol(optarg) >= 0)
+      K.budget = atol(optarg) * 1024 * 1024;
+    else if (opt == 'i')
+      X.index = 1;
+    else if (opt == 'l')
+      sock = optarg;
+    else if (opt == 'k')
+      S.keep_going = 1;
+    else if (opt == 'v')
+      S.verbose = 1;
+    else
+    {
+      fprintf(stderr, "usage: %s [-s script [-k] [-v]] [-l socket] [-m megabytes] [-i] [file]\n", argv[0]);
+      return 2;
+    }
+  }
+
   init();
-	if (argc >= 2)
+
+  if (sock != NULL)
+  {
+    res = run_server(sock);
+    buffers_free();
+    text_release(&ahelp);
+    free(frame.chars);
+    return res;
+  }
+
+  if (script != NULL)
+  {
+    res = run_script(script, optind < argc ? argv[optind] : NULL);
+    buffers_free();
+    save_wait();
+    text_release(&ahelp);
+    text_release(&T);
+    undo_drop();
+    free(frame.chars);
+    return res;
+  }
+
+  init_tty();
+	if (optind < argc)
   {
-    e_open(argv[1]);
+    e_open_async(argv[optind]);
   }
 
   struct arraystr ar;
-  ar.lines = NULL;
-  ar.num = 0;
+  struct tokenizer tk;
+
+  if (tokenizer_init(&tk, STDIN_FILENO) == MEM_ERROR)
+    return 1;
 
   while (1)
   {
-    freear(&ar);
     printf("editor: ");
-    read_command(&ar); 
+    fflush(stdout);
 
-    if (ar.num < 1)
-      err_com();
+    tokens_reset(&tk);
+    res = read_command(&tk, &ar);
 
-    /* Setters */
-    else if (!strcmp(ar.lines[0].chars, "set"))
+    if (res == EOF)
     {
-      if (ar.num != 3)
-      {
-        err_com();
-        continue;
-      }
-      if (!strcmp(ar.lines[1].chars, "wrap"))
-      {
-        if (!strcmp(ar.lines[2].chars, "yes"))
-          E.wrap = 1;
-        else if (!strcmp(ar.lines[2].chars, "no"))
-          E.wrap = 0;
-        else 
-          err_com();
-      }
-      else if (!strcmp(ar.lines[1].chars, "numbers"))
-      {
-        if (!strcmp(ar.lines[2].chars, "yes"))
-          E.numbers = 1;
-        else if (!strcmp(ar.lines[2].chars, "no"))
-          E.numbers = 0;
-        else 
-          err_com();
-      }
-      else if (!strcmp(ar.lines[1].chars, "tabwidth"))
-      {
-        if (atoi(ar.lines[2].chars) == 0)
-          err_com();
-        else
-          E.tabwidth = atoi(ar.lines[2].chars);
-      }
-      else if (!strcmp(ar.lines[1].chars, "name"))
-      {
-        if (ar.num > 3)
-          err_com();
-        else if (ar.lines[2].length == 0)
-        {
-          free(E.filename);
-          E.filename = NULL;
-        }
-        else
-          set_name(ar.lines[2].chars);
-      }
-      else
-        err_com();
+      printf("\n");
+      break;
     }
+    if (res != 0)
+      continue;
+
+    if (execute(&ar) == COM_EXIT)
+      break;
+  }
+
+  tokenizer_free(&tk);
+  buffers_free();
+  load_cancel();
+  save_wait();
+  text_release(&ahelp);
+  text_release(&T);
+  free(G.chars);
+  undo_drop();
+  macro_drop();
+  free(frame.chars);
+  
+} //main
+
+int insert_after(str toin, int pos)
+{
+  if (B.active)
+    return batch_insert(toin, pos);
+  return e_insert_after(toin, pos, &T);
+}
+
+int delete_range(int start, int end)
+{
+  if (B.active)
+    return batch_delete(start, end);
+  return e_delr(start, end);
+}
+
+/* commands that would renumber or replace the text under a queued batch */
+int batch_allowed(struct arraystr *ar)
+{
+  str last;
+
+  if (ar->num < 1) return 1;
+
+  if (!strcmp(ar->lines[0].chars, "read") || !strcmp(ar->lines[0].chars, "open")
+      || (!strcmp(ar->lines[0].chars, "write") && (ar->num != 2 || strcmp(ar->lines[1].chars, "status"))))
+    return 0;
+  if (ar->num > 1 && !strcmp(ar->lines[0].chars, "delete") && !strcmp(ar->lines[1].chars, "comments"))
+    return 0;
+  if (ar->num == 2 && !strcmp(ar->lines[0].chars, "print") && !strcmp(ar->lines[1].chars, "follow"))
+    return 0;
+  if (!strcmp(ar->lines[0].chars, "keep") || !strcmp(ar->lines[0].chars, "drop")
+      || !strcmp(ar->lines[0].chars, "sort") || !strcmp(ar->lines[0].chars, "uniq")
+      || !strcmp(ar->lines[0].chars, "undo") || !strcmp(ar->lines[0].chars, "filter"))
+    return 0;
+  if (!strcmp(ar->lines[0].chars, "replace"))
+  {
+    last = ar->lines[ar->num - 1];
+    return memchr(last.chars, '\n', last.length) == NULL;
+  }
+
+  return 1;
+}
+
+/* while the file loads, a command waits for the lines it needs: setters,
+   help, buffer, write status and exit need none (nothing can be edited before the
+   load is over), print range X Y needs Y, the pages on a tty the first of
+   them (paging takes the rest, see page_load), the rest all of them */
+void load_needed(struct arraystr *ar)
+{
+  if (ar->num < 1) return;
+
+  if (!strcmp(ar->lines[0].chars, "set") || !strcmp(ar->lines[0].chars, "help")
+      || !strcmp(ar->lines[0].chars, "buffer")
+      || (!strcmp(ar->lines[0].chars, "write") && ar->num == 2 && !strcmp(ar->lines[1].chars, "status"))
+      || !strcmp(ar->lines[0].chars, "exit"))
+    load_take();
+  else if (!strcmp(ar->lines[0].chars, "print") && ar->num == 4 && !strcmp(ar->lines[1].chars, "range")
+           && atoi(ar->lines[3].chars) > 0)
+    load_until(atoi(ar->lines[3].chars));
+  else if (E.tty && !strcmp(ar->lines[0].chars, "print") && ar->num == 2
+           && (!strcmp(ar->lines[1].chars, "pages") || !strcmp(ar->lines[1].chars, "range")))
+    load_until(E.height);
+  else if (E.tty && !strcmp(ar->lines[0].chars, "print") && ar->num == 3 && !strcmp(ar->lines[1].chars, "range")
+           && atoi(ar->lines[2].chars) > 0)
+    load_until(atoi(ar->lines[2].chars) + E.height);
+  else
+    load_until(INT_MAX);
+}
+
+/* the edits that work on the line in the gap buffer */
+int gap_command(struct arraystr *ar)
+{
+  if (ar->num != 5) return 0;
+  return (!strcmp(ar->lines[0].chars, "edit") && !strcmp(ar->lines[1].chars, "string"))
+         || (!strcmp(ar->lines[0].chars, "insert") && !strcmp(ar->lines[1].chars, "symbol"))
+         || (!strcmp(ar->lines[0].chars, "insert") && !strcmp(ar->lines[1].chars, "string"));
+}
+
+/* runs one parsed command, returns 0 on success, -1 on failure
+   and COM_EXIT when the editor should quit */
+int execute(struct arraystr *ar)
+{
+  struct step step;
+  int rec = 0;
+  int res = 0;
+
+  atomic_fetch_add(&K.tick, 1);
+  save_collect();
+  if (G.chars != NULL && (O.active || !gap_command(ar)) && gap_close() == MEM_ERROR)
+    return -1;
+  if (L.active)
+    load_needed(ar);
+  if (O.active)
+    follow_take(0);
+
+  if (B.active && !batch_allowed(ar))
+  {
+    msg("not allowed inside a batch, commit or rollback first\n");
+    return -1;
+  }
+
+  /* a line edit is parsed for the macro before it runs, to be kept
+     once it has */
+  if (M.active && (rec = macro_compile(ar, &step)) < 0)
+    return -1;
 
-    /* Print */
-    else if (!strcmp(ar.lines[0].chars, "print"))
+  if (ar->num < 1)
+    res = err_com();
+
+  /* Setters */
+  else if (!strcmp(ar->lines[0].chars, "set"))
+  {
+    if (ar->num != 3)
+      return err_com();
+
+    if (!strcmp(ar->lines[1].chars, "wrap"))
     {
-      if (ar.num == 1)
-        err_com();
-      else if (!strcmp(ar.lines[1].chars, "pages"))
-      {
-        if (ar.num > 2)
-          err_com();
-        else
-          print(1, T.num, &T);
-      }
-      else if (!strcmp(ar.lines[1].chars, "range"))
-      {
-        if (ar.num == 2)
-          print(1, T.num, &T);
-        else if (ar.num == 3)
-        {
-          if (!atoi(ar.lines[2].chars)) 
-            err_com();
-          else 
-            print(atoi(ar.lines[2].chars), T.num, &T);
-        }
-        else if (ar.num == 4)
-        {
-          if (!atoi(ar.lines[2].chars) || !atoi(ar.lines[3].chars))
-            err_com();
-          else
-            print(atoi(ar.lines[2].chars), atoi(ar.lines[3].chars), &T);
-        }
-        else
-          err_com();
-      }
-      else
-      {
-        err_com();
-      }
+      if (!strcmp(ar->lines[2].chars, "yes"))
+        E.wrap = 1;
+      else if (!strcmp(ar->lines[2].chars, "no"))
+        E.wrap = 0;
+      else 
+        res = err_com();
     }
-
-    /* File interactions */
-    else if (!strcmp(ar.lines[0].chars, "read"))
+    else if (!strcmp(ar->lines[1].chars, "numbers"))
     {
-      if (ar.num != 2)
-        err_com();
-      else
-        e_read(ar.lines[1].chars);
+      if (!strcmp(ar->lines[2].chars, "yes"))
+        E.numbers = 1;
+      else if (!strcmp(ar->lines[2].chars, "no"))
+        E.numbers = 0;
+      else 
+        res = err_com();
     }
-    else if (!strcmp(ar.lines[0].chars, "open"))
+    else if (!strcmp(ar->lines[1].chars, "tabwidth"))
     {
-      if (ar.num != 2)
-        err_com();
+      if (atoi(ar->lines[2].chars) == 0)
+        res = err_com();
       else
-        e_open(ar.lines[1].chars);
+        E.tabwidth = atoi(ar->lines[2].chars);
     }
-    else if (!strcmp(ar.lines[0].chars, "write"))
+    else if (!strcmp(ar->lines[1].chars, "memory-budget"))
     {
-      if (ar.num == 1)
-        e_write(NULL);
-      else if (ar.num == 2)
-        e_write(ar.lines[1].chars);
+      char *end;
+      long mb = strtol(ar->lines[2].chars, &end, 10);
+
+      if (*end != '\0' || mb < 0 || ar->lines[2].length == 0)
+        res = err_com();
       else
-        err_com();
+        E.budget = mb * 1024 * 1024;
     }
-
-    /*  */
-    else if (!strcmp(ar.lines[0].chars, "edit"))
+    else if (!strcmp(ar->lines[1].chars, "index"))
     {
-      if (ar.num != 5 || strcmp(ar.lines[1].chars, "string") || 
-              !atoi(ar.lines[2].chars) || !atoi(ar.lines[3].chars) || ar.lines[4].length != 1)
-        err_com();
-      else e_edit(&T.lines[atoi(ar.lines[2].chars) - 1], *ar.lines[4].chars, atoi(ar.lines[3].chars));
+      if (!strcmp(ar->lines[2].chars, "yes"))
+        E.index = 1;
+      else if (!strcmp(ar->lines[2].chars, "no"))
+        E.index = 0;
+      else
+        res = err_com();
     }
-    else if (!strcmp(ar.lines[0].chars, "insert"))
+    else if (!strcmp(ar->lines[1].chars, "intern"))
     {
-      if (ar.num == 5 && !strcmp(ar.lines[1].chars, "symbol"))
-      {
-        if (!atoi(ar.lines[2].chars) || !atoi(ar.lines[3].chars) || ar.lines[4].length != 1)
-          err_com();
-        else 
-          e_insert_symbol(&T.lines[atoi(ar.lines[2].chars) - 1], *ar.lines[4].chars, atoi(ar.lines[3].chars));
-      }
-      else if (!strcmp(ar.lines[1].chars, "after"))
+      if (!strcmp(ar->lines[2].chars, "yes"))
       {
-        if (ar.num == 3)
-          e_insert_after(ar.lines[2], T.num, &T);
-        else if (ar.num == 4)
+        /* interning frees the storage of duplicates, which the undo
+           record may still point at */
+        if (!E.intern)
         {
-          if (atoi(ar.lines[2].chars))
-          {
-            if (atoi(ar.lines[2].chars) < 0 || atoi(ar.lines[2].chars) > T.num)
-              printf("out of bounds\n");
-            else
-              e_insert_after(ar.lines[3], atoi(ar.lines[2].chars), &T);
-          }
-          else if (ar.lines[2].length == 1 && ar.lines[2].chars[0] == '0')
-            e_insert_after(ar.lines[3], 0, &T);
-          else err_com();
+          undo_drop();
+          res = text_intern(&T, 0, T.num);
         }
-        else err_com();
+        E.intern = 1;
       }
+      else if (!strcmp(ar->lines[2].chars, "no"))
+        E.intern = 0;
       else
-        err_com();
+        res = err_com();
     }
-    else if (!strcmp(ar.lines[0].chars, "delete"))
+    else if (!strcmp(ar->lines[1].chars, "name"))
     {
-      if (ar.num > 2 && !strcmp(ar.lines[1].chars, "range") && atoi(ar.lines[2].chars))
-        if (ar.num == 3)
-          e_delr(atoi(ar.lines[2].chars), T.num);
-        else if (ar.num == 4)
-          if(!atoi(ar.lines[3].chars))
-            err_com();
-          else
-            e_delr(atoi(ar.lines[2].chars), atoi(ar.lines[3].chars));
-        else
-          err_com();
-      else if (ar.num == 3 && !strcmp(ar.lines[1].chars, "comments"))
+      if (ar->lines[2].length == 0)
       {
-        if (!strcmp(ar.lines[2].chars, "pascal"))
-          e_delcom(1);
-        else if (!strcmp(ar.lines[2].chars, "shell"))
-          e_delcom(2);
-        else if (!strcmp(ar.lines[2].chars, "c"))
-          e_delcom(3);
-        else if (!strcmp(ar.lines[2].chars, "c++"))
-          e_delcom(4);
+        free(E.filename);
+        E.filename = NULL;
       }
-      else err_com();
-        
+      else
+        set_name(ar->lines[2].chars);
     }
-    else if (!strcmp(ar.lines[0].chars, "replace"))
+    else
+      res = err_com();
+  }
+
+  /* Print */
+  else if (!strcmp(ar->lines[0].chars, "print"))
+  {
+    if (ar->num == 1)
+      res = err_com();
+    else if (!strcmp(ar->lines[1].chars, "pages"))
     {
-      if (ar.num < 4 || strcmp(ar.lines[1].chars, "substring"))
-        err_com();
-      else if (ar.num > 4 && atoi(ar.lines[2].chars))
-      {
-        if (ar.num == 6 && atoi(ar.lines[3].chars))
-          e_replace_substr(atoi(ar.lines[2].chars), atoi(ar.lines[3].chars), ar.lines[4], ar.lines[5]);
-        else if (ar.num == 5)
-          e_replace_substr(atoi(ar.lines[2].chars), T.num, ar.lines[3], ar.lines[4]);
-        else
-          err_com();
-      }
-      else if (ar.num == 4)
-        e_replace_substr(1, T.num, ar.lines[2], ar.lines[3]);
+      if (ar->num > 2)
+        res = err_com();
       else
-        err_com();
+        res = print(1, INT_MAX, &T);
     }
-    else if (!strcmp(ar.lines[0].chars, "help"))
+    else if (!strcmp(ar->lines[1].chars, "follow"))
     {
-      if (ar.num > 1)
-        err_com();
-      else e_help();
+      if (ar->num > 2)
+        res = err_com();
+      else
+        res = print_follow();
     }
-
-    else if (!strcmp(ar.lines[0].chars, "exit"))
+    else if (!strcmp(ar->lines[1].chars, "render"))
+    {
+      if (ar->num > 2)
+        res = err_com();
+      else
+        fprintf(output(), "frames rendered: %ld, heap allocations while rendering: %ld\n", R.frames, R.allocs);
+    }
+    else if (!strcmp(ar->lines[1].chars, "range"))
     {
-      if (ar.num == 2 && !strcmp(ar.lines[1].chars, "force"))
+      if (ar->num == 2)
+        res = print(1, INT_MAX, &T);
+      else if (ar->num == 3)
       {
-        freear(&ar);
-        break;
-      }
-      else if (ar.num == 1)
-        if (E.saved)
-        {
-          freear(&ar);
-          break;
-        }
+        if (!atoi(ar->lines[2].chars)) 
+          res = err_com();
         else 
-          printf("progress wasn`t saved, unable to exit\n");
+          res = print(atoi(ar->lines[2].chars), INT_MAX, &T);
+      }
+      else if (ar->num == 4)
+      {
+        if (!atoi(ar->lines[2].chars) || !atoi(ar->lines[3].chars))
+          res = err_com();
+        else
+          res = print(atoi(ar->lines[2].chars), atoi(ar->lines[3].chars), &T);
+      }
       else
-        err_com();
+        res = err_com();
     }
-
     else
-      err_com();
+    {
+      res = err_com();
+    }
+  }
 
-    freear(&ar);
-  
+  /* File interactions */
+  else if (!strcmp(ar->lines[0].chars, "read"))
+  {
+    if (ar->num != 2)
+      res = err_com();
+    else
+      res = e_read(ar->lines[1].chars);
+  }
+  else if (!strcmp(ar->lines[0].chars, "diff"))
+  {
+    if (ar->num > 2)
+      res = err_com();
+    else
+      res = e_diff(ar->num == 2 ? ar->lines[1].chars : E.filename);
+  }
+  else if (!strcmp(ar->lines[0].chars, "follow"))
+  {
+    if (ar->num == 1)
+      res = follow_start();
+    else if (ar->num == 2 && !strcmp(ar->lines[1].chars, "stop"))
+      follow_stop();
+    else
+      res = err_com();
+  }
+  else if (!strcmp(ar->lines[0].chars, "open"))
+  {
+    if (ar->num != 2)
+      res = err_com();
+    else
+      res = e_open(ar->lines[1].chars);
+  }
+  else if (!strcmp(ar->lines[0].chars, "write"))
+  {
+    if (ar->num == 1)
+      res = e_write(NULL) ? -1 : 0;
+    else if (ar->num == 2 && !strcmp(ar->lines[1].chars, "status"))
+      save_status();
+    else if (ar->num == 2)
+      res = e_write(ar->lines[1].chars) ? -1 : 0;
+    else
+      res = err_com();
   }
 
-  freear(&ahelp);
-  freear(&T);
-  
-} //main
+  /*  */
+  else if (!strcmp(ar->lines[0].chars, "edit"))
+  {
+    if (ar->num != 5 || strcmp(ar->lines[1].chars, "string") || 
+            !atoi(ar->lines[2].chars) || !atoi(ar->lines[3].chars) || ar->lines[4].length != 1)
+      res = err_com();
+    else if (!line_ok(atoi(ar->lines[2].chars)))
+      res = -1;
+    else
+      res = e_edit(atoi(ar->lines[2].chars) - 1, *ar->lines[4].chars, atoi(ar->lines[3].chars));
+  }
+  else if (!strcmp(ar->lines[0].chars, "insert"))
+  {
+    if (ar->num == 5 && !strcmp(ar->lines[1].chars, "symbol"))
+    {
+      if (!atoi(ar->lines[2].chars) || !atoi(ar->lines[3].chars) || ar->lines[4].length != 1)
+        res = err_com();
+      else if (!line_ok(atoi(ar->lines[2].chars)))
+        res = -1;
+      else 
+        res = e_insert_symbol(atoi(ar->lines[2].chars) - 1, *ar->lines[4].chars, atoi(ar->lines[3].chars));
+    }
+    else if (ar->num == 5 && !strcmp(ar->lines[1].chars, "string"))
+    {
+      if (!atoi(ar->lines[2].chars) || !atoi(ar->lines[3].chars))
+        res = err_com();
+      else if (!line_ok(atoi(ar->lines[2].chars)))
+        res = -1;
+      else
+        res = e_insert_string(atoi(ar->lines[2].chars) - 1, ar->lines[4], atoi(ar->lines[3].chars));
+    }
+    else if (ar->num > 1 && !strcmp(ar->lines[1].chars, "after"))
+    {
+      if (ar->num == 3)
+        res = insert_after(ar->lines[2], T.num);
+      else if (ar->num == 4)
+      {
+        if (atoi(ar->lines[2].chars))
+        {
+          if (atoi(ar->lines[2].chars) < 0 || atoi(ar->lines[2].chars) > T.num)
+          {
+            msg("out of bounds\n");
+            res = -1;
+          }
+          else
+            res = insert_after(ar->lines[3], atoi(ar->lines[2].chars));
+        }
+        else if (ar->lines[2].length == 1 && ar->lines[2].chars[0] == '0')
+          res = insert_after(ar->lines[3], 0);
+        else res = err_com();
+      }
+      else res = err_com();
+      if (res > 0) res = 0;
+    }
+    else if (ar->num > 2 && !strcmp(ar->lines[1].chars, "file"))
+    {
+      if (ar->num == 3)
+        res = e_insert_file(ar->lines[2].chars, B.active ? B.base : T.num);
+      else if (ar->num == 5 && !strcmp(ar->lines[3].chars, "after")
+               && (atoi(ar->lines[4].chars) || (ar->lines[4].length == 1 && ar->lines[4].chars[0] == '0')))
+        res = e_insert_file(ar->lines[2].chars, atoi(ar->lines[4].chars));
+      else res = err_com();
+    }
+    else if (ar->num > 2 && !strcmp(ar->lines[1].chars, "buffer"))
+    {
+      if (ar->num == 3)
+        res = e_insert_buffer(atoi(ar->lines[2].chars), B.active ? B.base : T.num);
+      else if (ar->num == 5 && !strcmp(ar->lines[3].chars, "after")
+               && (atoi(ar->lines[4].chars) || (ar->lines[4].length == 1 && ar->lines[4].chars[0] == '0')))
+        res = e_insert_buffer(atoi(ar->lines[2].chars), atoi(ar->lines[4].chars));
+      else res = err_com();
+    }
+    else
+      res = err_com();
+  }
+  else if (!strcmp(ar->lines[0].chars, "delete"))
+  {
+    if (ar->num > 2 && !strcmp(ar->lines[1].chars, "range") && atoi(ar->lines[2].chars))
+    {
+      if (ar->num == 3)
+        res = delete_range(atoi(ar->lines[2].chars), T.num);
+      else if (ar->num == 4)
+        if(!atoi(ar->lines[3].chars))
+          res = err_com();
+        else
+          res = delete_range(atoi(ar->lines[2].chars), atoi(ar->lines[3].chars));
+      else
+        res = err_com();
+    }
+    else if (ar->num > 2 && !strcmp(ar->lines[1].chars, "lines"))
+      res = delete_lines(ar, 2);
+    else if (ar->num == 3 && !strcmp(ar->lines[1].chars, "comments"))
+    {
+      if (!strcmp(ar->lines[2].chars, "pascal"))
+        res = e_delcom(1);
+      else if (!strcmp(ar->lines[2].chars, "shell"))
+        res = e_delcom(2);
+      else if (!strcmp(ar->lines[2].chars, "c"))
+        res = e_delcom(3);
+      else if (!strcmp(ar->lines[2].chars, "c++"))
+        res = e_delcom(4);
+      else
+        res = err_com();
+    }
+    else res = err_com();
+      
+  }
+  else if (!strcmp(ar->lines[0].chars, "replace"))
+  {
+    if (ar->num < 4 || strcmp(ar->lines[1].chars, "substring"))
+      res = err_com();
+    else if (ar->num > 4 && atoi(ar->lines[2].chars))
+    {
+      if (ar->num == 6 && atoi(ar->lines[3].chars))
+        res = e_replace_substr(atoi(ar->lines[2].chars), atoi(ar->lines[3].chars), ar->lines[4], ar->lines[5]);
+      else if (ar->num == 5)
+        res = e_replace_substr(atoi(ar->lines[2].chars), T.num, ar->lines[3], ar->lines[4]);
+      else
+        res = err_com();
+    }
+    else if (ar->num == 4)
+      res = e_replace_substr(1, T.num, ar->lines[2], ar->lines[3]);
+    else
+      res = err_com();
+  }
+  else if (!strcmp(ar->lines[0].chars, "keep") || !strcmp(ar->lines[0].chars, "drop"))
+  {
+    int mode = ar->num > 1 && !strcmp(ar->lines[1].chars, "regex") ? MATCH_REGEX : MATCH_LITERAL;
+    int keep = !strcmp(ar->lines[0].chars, "keep");
+
+    if (ar->num < 3 || (mode == MATCH_LITERAL && strcmp(ar->lines[1].chars, "matching")))
+      res = err_com();
+    else if (ar->num == 3)
+      res = T.num ? e_filter(1, T.num, ar->lines[2], mode, keep) : 0;
+    else if (ar->num == 4 && atoi(ar->lines[3].chars))
+      res = e_filter(atoi(ar->lines[3].chars), T.num, ar->lines[2], mode, keep);
+    else if (ar->num == 5 && atoi(ar->lines[3].chars) && atoi(ar->lines[4].chars))
+      res = e_filter(atoi(ar->lines[3].chars), atoi(ar->lines[4].chars), ar->lines[2], mode, keep);
+    else
+      res = err_com();
+  }
+  else if (!strcmp(ar->lines[0].chars, "sort") || !strcmp(ar->lines[0].chars, "uniq"))
+  {
+    int flags = 0;
+    int k = 1;
+
+    for (; k < ar->num && !strcmp(ar->lines[0].chars, "sort"); k++)
+    {
+      if (!strcmp(ar->lines[k].chars, "numeric"))
+        flags |= SORT_NUMERIC;
+      else if (!strcmp(ar->lines[k].chars, "reverse"))
+        flags |= SORT_REVERSE;
+      else break;
+    }
+
+    if (k >= ar->num || strcmp(ar->lines[k].chars, "range") || ar->num - k > 3
+        || (ar->num - k > 1 && !atoi(ar->lines[k + 1].chars))
+        || (ar->num - k > 2 && !atoi(ar->lines[k + 2].chars)))
+      res = err_com();
+    else if (ar->num - k == 1 && T.num == 0)
+      res = 0;
+    else
+    {
+      int start = ar->num - k > 1 ? atoi(ar->lines[k + 1].chars) : 1;
+      int end = ar->num - k > 2 ? atoi(ar->lines[k + 2].chars) : T.num;
+
+      if (!strcmp(ar->lines[0].chars, "sort"))
+        res = e_sort(start, end, flags);
+      else
+        res = e_uniq(start, end);
+    }
+  }
+  else if (!strcmp(ar->lines[0].chars, "filter"))
+  {
+    if (ar->num < 3 || ar->num > 5 || strcmp(ar->lines[1].chars, "range")
+        || (ar->num > 3 && !atoi(ar->lines[2].chars))
+        || (ar->num > 4 && !atoi(ar->lines[3].chars)))
+      res = err_com();
+    else if (ar->num == 3)
+      res = T.num ? e_pipe(1, T.num, ar->lines[2].chars) : 0;
+    else if (ar->num == 4)
+      res = e_pipe(atoi(ar->lines[2].chars), T.num, ar->lines[3].chars);
+    else
+      res = e_pipe(atoi(ar->lines[2].chars), atoi(ar->lines[3].chars), ar->lines[4].chars);
+  }
+  else if (!strcmp(ar->lines[0].chars, "undo"))
+  {
+    if (ar->num > 1)
+      res = err_com();
+    else
+      res = e_undo();
+  }
+  else if (!strcmp(ar->lines[0].chars, "begin"))
+  {
+    if (ar->num > 1)
+      res = err_com();
+    else
+      res = e_begin();
+  }
+  else if (!strcmp(ar->lines[0].chars, "commit"))
+  {
+    if (ar->num > 1)
+      res = err_com();
+    else
+      res = e_commit();
+  }
+  else if (!strcmp(ar->lines[0].chars, "rollback"))
+  {
+    if (ar->num > 1)
+      res = err_com();
+    else
+      res = e_rollback();
+  }
+  else if (!strcmp(ar->lines[0].chars, "buffer"))
+  {
+    if (ar->num == 3 && !strcmp(ar->lines[1].chars, "open"))
+      res = e_buffer_open(ar->lines[2].chars);
+    else if (ar->num == 3 && !strcmp(ar->lines[1].chars, "switch"))
+      res = e_buffer_switch(atoi(ar->lines[2].chars));
+    else if (ar->num == 2 && !strcmp(ar->lines[1].chars, "list"))
+      e_buffer_list();
+    else
+      res = err_com();
+  }
+  else if (!strcmp(ar->lines[0].chars, "help"))
+  {
+    if (ar->num > 1)
+      res = err_com();
+    else e_help();
+  }
+  else if (!strcmp(ar->lines[0].chars, "stats"))
+  {
+    if (ar->num == 1)
+      e_stats(0, T.num);
+    else if (ar->num > 3 || !atoi(ar->lines[1].chars) || (ar->num == 3 && !atoi(ar->lines[2].chars)))
+      res = err_com();
+    else if (!line_ok(atoi(ar->lines[1].chars)))
+      res = -1;
+    else if (ar->num == 2)
+      e_stats(atoi(ar->lines[1].chars) - 1, T.num);
+    else if (atoi(ar->lines[2].chars) < atoi(ar->lines[1].chars))
+      res = err_com();
+    else
+      e_stats(atoi(ar->lines[1].chars) - 1, atoi(ar->lines[2].chars) > T.num ? T.num : atoi(ar->lines[2].chars));
+  }
+
+  else if (!strcmp(ar->lines[0].chars, "exit"))
+  {
+    if (W.pending)
+    {
+      msg("waiting for the save to %s to finish\n", W.filename);
+      save_wait();
+    }
+    buffers_wait();
+
+    if (ar->num == 2 && !strcmp(ar->lines[1].chars, "force"))
+      res = COM_EXIT;
+    else if (ar->num == 1)
+      if (!E.saved)
+      {
+        msg("progress wasn`t saved, unable to exit\n");
+        res = -1;
+      }
+      else if (buffers_unsaved() >= 0)
+      {
+        msg("buffer %d wasn`t saved, unable to exit\n", buffers_unsaved() + 1);
+        res = -1;
+      }
+      else
+        res = COM_EXIT;
+    else
+      res = err_com();
+  }
+
+  else if (!strcmp(ar->lines[0].chars, "record"))
+  {
+    if (ar->num != 1)
+      res = err_com();
+    else if (M.active)
+    {
+      msg("already recording\n");
+      res = -1;
+    }
+    else
+    {
+      macro_drop();
+      M.active = 1;
+    }
+  }
+  else if (!strcmp(ar->lines[0].chars, "stop"))
+  {
+    if (ar->num != 1)
+      res = err_com();
+    else if (!M.active)
+    {
+      msg("not recording\n");
+      res = -1;
+    }
+    else
+      M.active = 0;
+  }
+  else if (!strcmp(ar->lines[0].chars, "replay"))
+  {
+    if (ar->num != 5 || strcmp(ar->lines[1].chars, "macro") || strcmp(ar->lines[2].chars, "over")
+        || !atoi(ar->lines[3].chars) || !atoi(ar->lines[4].chars))
+      res = err_com();
+    else
+      res = e_replay(atoi(ar->lines[3].chars), atoi(ar->lines[4].chars));
+  }
+
+  else
+    res = err_com();
+
+  if (rec > 0 && (res != 0 || macro_add(&step) == MEM_ERROR))
+  {
+    free(step.text.chars);
+    free(step.find.chars);
+    if (res == 0) res = MEM_ERROR;
+  }
+
+  squeeze(&T);
+  return res < 0 ? -1 : res;
+}
 
 
 
@@ -428,40 +1409,92 @@ void init_help()
   append(&buf, "\n\n\t\tset numbers (yes/no) -- enables/disables line counter", 57);
   append(&buf, "\n\n\t\tset tabwidth (X) -- sets tabwidth to X", 42);
   append(&buf, "\n\n\t\tprint pages -- show the whole text; while active:\n\t\t\t-press space to show next page",87);
+  append(&buf, "\n\t\t\t-press \'b\' to show previous page", 36);
   append(&buf, "\n\t\t\t-press \'<\'/\''>\'' to scroll left/right (only if wrap is off)", 61);
   append(&buf, "\n\n\t\tprint range [X] [Y] -- shows lines in selected boundaries (from X to Y)", 75);
   append(&buf, "\n\t\t\t-if used without Y, prints lines from X to END", 51);
   append(&buf, "\n\t\t\t-if used without X and Y, prints all the lines", 50);
+  append(&buf, "\n\n\t\tprint follow -- shows the end of the text and scrolls as the file grows, q leaves", 85);
+  append(&buf, "\n\n\t\tprint render -- shows frames drawn and heap allocations made drawing them", 77);
+  append(&buf, "\n\n\t\tstats [X] [Y] -- counts lines, bytes, words and tabs from X to Y, finds the longest", 87);
+  append(&buf, "\n\t\t\t-without X and Y on the whole text, also shows what interning saves", 71);
   append(&buf, "\n\n\tLINE INSERT", 14);
   append(&buf, "\n\n\t\tinsert after [X] (\"S\") -- puts string S after line X in text", 65);
   append(&buf, "\n\t\t\t-if used without X, puts S at the end of text", 49);
   append(&buf, "\n\t\t\t-S can be input in several lines like \"\"\"S\"\"\"", 49);
+  append(&buf, "\n\n\t\tinsert file (\"F\") [after X] -- puts the lines of file F after line X in text", 80);
+  append(&buf, "\n\t\t\t-if used without after X, puts them at the end of text", 58);
+  append(&buf, "\n\n\t\tinsert buffer (N) [after X] -- puts a copy of the lines of buffer N after line X", 84);
   append(&buf, "\n\n\tLINE EDIT", 12);
   append(&buf, "\n\n\t\tedit string (X) (Y) (C) -- changes symbol in line X in position Y to C", 74);
   append(&buf, "\n\n\t\tinsert symbol (X) (Y) (C) -- inserts symbol C in line X in position Y", 73);
+  append(&buf, "\n\n\t\tinsert string (X) (Y) (\"S\") -- inserts string S in line X from position Y", 77);
   append(&buf, "\n\n\t\treplace substring [X] [Y] (\"R\") (\"S\") -- replaces sequence R to S in lines", 78);
   append(&buf, "\n\t\t\t-use with X to change lines from X to END", 45);
   append(&buf, "\n\t\t\t-use with X and Y to change lines from X to Y", 49);
   append(&buf, "\n\t\t\t-R can be \'^\'/\'$\' to insert S to beginning/end of lines", 60);
   append(&buf, "\n\n\t\tdelete range (X) [Y] -- removes lines from X to Y (or END if Y is not specified)", 85);
+  append(&buf, "\n\n\t\tdelete lines (L) -- removes the lines listed in L, like 3,7,10-200", 70);
   append(&buf, "\n\n\t\tdelete comments (T) -- removes comments of type T (pascal/c/c++/shell)", 74);
+  append(&buf, "\n\n\t\tkeep matching (\"S\") [X] [Y] -- leaves only the lines from X to Y containing S", 81);
+  append(&buf, "\n\t\t\t-without Y works from X to END, without X and Y on the whole text", 69);
+  append(&buf, "\n\t\t\t-\"keep regex\" takes S as an extended regular expression", 59);
+  append(&buf, "\n\n\t\tdrop matching (\"S\") [X] [Y] -- removes the lines from X to Y containing S", 77);
+  append(&buf, "\n\t\t\t-same range rules, \"drop regex\" takes S as a regular expression", 67);
+  append(&buf, "\n\n\t\tfilter range [X] [Y] (\"C\") -- pipes lines from X to Y through shell command C", 81);
+  append(&buf, "\n\t\t\t-its output replaces them, they are kept if C does not exit with 0", 70);
+  append(&buf, "\n\n\tSORTING", 10);
+  append(&buf, "\n\n\t\tsort [numeric] [reverse] range [X] [Y] -- sorts lines from X to Y", 69);
+  append(&buf, "\n\t\t\t-bytewise by default, by the leading number with numeric", 60);
+  append(&buf, "\n\t\t\t-without Y sorts from X to END, without X and Y the whole text", 66);
+  append(&buf, "\n\n\t\tuniq range [X] [Y] -- removes lines equal to the one before them", 68);
+  append(&buf, "\n\n\t\tundo -- takes back the last sort or uniq if nothing was edited since", 72);
+  append(&buf, "\n\n\tBATCHES", 10);
+  append(&buf, "\n\n\t\tbegin -- starts a batch, insert after and delete range are queued until commit", 82);
+  append(&buf, "\n\t\t\t-line numbers refer to the text as it was at begin", 54);
+  append(&buf, "\n\n\t\tcommit -- applies the queued edits in one pass", 50);
+  append(&buf, "\n\n\t\trollback -- drops the queued edits", 38);
+  append(&buf, "\n\n\tMACROS", 9);
+  append(&buf, "\n\n\t\trecord -- starts keeping the line edits that follow as the macro", 68);
+  append(&buf, "\n\t\t\t-edit string, insert symbol, insert string and replace substring X Y", 72);
+  append(&buf, "\n\n\t\tstop -- ends the macro", 26);
+  append(&buf, "\n\n\t\treplay macro over (X) (Y) -- runs the macro once for each line from X to Y", 78);
+  append(&buf, "\n\t\t\t-the lines it edits are taken relative to the first one it edited", 69);
   append(&buf, "\n\n\tTECH COMMANDS", 16);
   append(&buf, "\n\n\t\texit -- closes editor if saved (use \"exit force\" to close even if not saved)", 80);
   append(&buf, "\n\n\t\tread (\"F\") -- reads lines from file F to memory", 51);
   append(&buf, "\n\n\t\topen (\"F\") -- read + remembers F as filename", 48);
+  append(&buf, "\n\n\t\tdiff [\"F\"] -- shows how the text differs from file F (or filename) as a unified diff", 88);
+  append(&buf, "\n\n\t\tfollow [stop] -- keeps adding what is appended to the file to the text", 74);
+  append(&buf, "\n\t\t\t-a file that is truncated or replaced, as logs are rotated, is read again", 77);
   append(&buf, "\n\n\t\twrite [\"F\"] -- writes lines to file F (or to filename if F is not specified)", 80);
+  append(&buf, "\n\t\t\t-the write goes on in the background, editing can continue", 62);
+  append(&buf, "\n\n\t\twrite status -- shows how far the background write got", 58);
   append(&buf, "\n\n\t\tset name (\"S\") -- sets filename to S", 40);
+  append(&buf, "\n\n\t\tset memory-budget (X) -- keeps the lines in about X MB, compressing the ones not read lately", 96);
+  append(&buf, "\n\t\t\t-lines that do not fit even compressed go out to a temp file", 64);
+  append(&buf, "\n\t\t\t-0 turns it off, the default is 0 or the X of -m X", 54);
+  append(&buf, "\n\n\t\tset intern (yes/no) -- stores identical lines read from files once", 70);
+  append(&buf, "\n\t\t\t-a line gets storage of its own again when it is edited", 59);
+  append(&buf, "\n\n\t\tset index (yes/no) -- opens files through an index F.idx kept next to them", 78);
+  append(&buf, "\n\t\t\t-lines are read from F when first needed, so opening is instant", 67);
+  append(&buf, "\n\t\t\t-the default is no, or yes with -i", 38);
+  append(&buf, "\n\n\tBUFFERS", 10);
+  append(&buf, "\n\n\t\tbuffer open (\"F\") -- opens file F in a buffer of its own and switches to it", 79);
+  append(&buf, "\n\t\t\t-if F is open already, switches to its buffer", 49);
+  append(&buf, "\n\n\t\tbuffer switch (N) -- makes buffer N the current one", 55);
+  append(&buf, "\n\n\t\tbuffer list -- shows the buffers, the current one marked with *", 67);
 
-  ahelp.lines = NULL;
-  ahelp.num = 0;
   str tmp;
   tmp.chars = buf.chars;
   tmp.length = buf.len;
   e_insert_after(tmp, 0, &ahelp);
+  free(buf.chars);
   E.saved = 1;
 }
 
-int init()
+/* settings of a new document */
+void init_document()
 {
   E.tabwidth = 4;
   E.wrap = 0;
@@ -470,10 +1503,29 @@ int init()
   E.filename = NULL;
   E.printing = 0;
   E.saved = 1;
+  E.tty = 0;
+  E.width = 80;
+  E.height = 23;
+  E.budget = K.budget;
+  E.intern = 0;
+  E.index = X.index;
+}
+
+int init()
+{
+  init_document();
+  init_help();
+  buffer_add(&main_doc);
+
+  return 0;
+}
+
+/* terminal setup, skipped when running a script */
+int init_tty()
+{
   get_window_size();
-  init_modes();
+  E.tty = init_modes() == 0;
   signal(SIGWINCH, sighandler);
-  init_help();
 
   return 0;
 }
@@ -508,14 +1560,15 @@ int enable_raw_mode()
 void disable_raw_mode()
 {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
-    printf("failed to disable raw mode\n");
+    msg("failed to disable raw mode\n");
 }
 
 int get_window_size()
 {
   struct winsize ws;
 
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+    return -1;
   
   E.width = ws.ws_col;
   E.height = ws.ws_row - 1;
@@ -525,950 +1578,7373 @@ int get_window_size()
 }
 
 
-/* FILE I/O
-  _______________________
+/* INTERNING
+  __________
 */
-ssize_t get_line(FILE *f, char **line, int *eofflag)
-{
-    buffer buf = NEWBUF;
-    char c;
 
-    *eofflag = 0;
+/* with set intern yes the lines read into a text point at one copy of
+   each distinct content. An atom counts the lines sharing its chars; it
+   is found by content when a line is interned and by address when a line
+   is freed or about to change, so a line is still just a char pointer */
 
-    while(1)
-    {
-        c = fgetc(f);
+uint32_t intern_hash(char *s, int len)
+{
+  uint32_t h = 2166136261u;
+  int j;
 
-        if (c == '\n' || (c == EOF && (*eofflag = 1))) break;
+  for (j = 0; j < len; j++)
+    h = (h ^ (unsigned char)s[j]) * 16777619u;
 
-        append(&buf, &c, 1);
-    }
+  return h;
+}
+
+int addr_slot(char *chars, int mem)
+{
+  return ((uint32_t)((uintptr_t)chars >> 4) * 2654435761u) & (mem - 1);
+}
 
-    endbuf(&buf);
+/* the atom chars belongs to, under A.lock */
+struct atom *atom_of(char *chars)
+{
+  struct atom *a;
 
-    *line = buf.chars;
+  if (A.mem == 0) return NULL;
 
-    return buf.len;
+  for (a = A.addr[addr_slot(chars, A.mem)]; a != NULL && a->chars != chars; a = a->anext);
+  return a;
 }
 
-ssize_t read_file(FILE *f, str **lines)
+int intern_grow()
 {
-    str *buff = NULL;
-    str *tmp = NULL;
-    str line;
-    size_t size = 0;
-    size_t mem = 0;
-    int eofflag;
+  struct atom **text = NULL;
+  struct atom **addr = NULL;
+  struct atom *a;
+  struct atom *next;
+  int mem = A.mem == 0 ? 1024 : A.mem * 2;
+  int k;
 
-    while (1)
-    {
-        line.length = get_line(f, &line.chars, &eofflag);
-        if (line.length < 0) break;
+  text = (struct atom**)calloc(mem, sizeof(struct atom*));
+  addr = (struct atom**)calloc(mem, sizeof(struct atom*));
+  if (text == NULL || addr == NULL)
+  {
+    free(text);
+    free(addr);
+    return MEM_ERROR;
+  }
 
-        if (size == mem)
-        {
-            mem += BUFFADD;
-            tmp = (str*) realloc(buff, mem * sizeof(str));
-            if (tmp == NULL) return MEM_ERROR;
+  for (k = 0; k < A.mem; k++)
+    for (a = A.text[k]; a != NULL; a = next)
+    {
+      next = a->next;
+      a->next = text[a->hash & (mem - 1)];
+      text[a->hash & (mem - 1)] = a;
+      a->anext = addr[addr_slot(a->chars, mem)];
+      addr[addr_slot(a->chars, mem)] = a;
+    }
 
-            buff = tmp;
-        }
+  free(A.text);
+  free(A.addr);
+  A.text = text;
+  A.addr = addr;
+  A.mem = mem;
+  return 0;
+}
 
-        buff[size++] = line;
+/* points line at the atom holding its content, or makes its storage
+   the atom later copies of it will share */
+int line_intern(str *line)
+{
+  struct atom *a;
+  char *old = NULL;
+  uint32_t h;
 
-        if (eofflag) break;
+  pthread_mutex_lock(&A.lock);
+  if (atom_of(line->chars) != NULL)
+  {
+    pthread_mutex_unlock(&A.lock);
+    return 0;
+  }
 
-    }
+  h = intern_hash(line->chars, line->length);
+  for (a = A.mem == 0 ? NULL : A.text[h & (A.mem - 1)]; a != NULL; a = a->next)
+    if (a->hash == h && a->length == line->length && !memcmp(a->chars, line->chars, line->length))
+      break;
 
-    tmp = (str*)realloc(buff, size * sizeof(str));
-    if(tmp == NULL) return MEM_ERROR;
+  if (a != NULL)
+  {
+    a->refs++;
+    old = line->chars;
+    line->chars = a->chars;
+  }
+  else
+  {
+    if (atomic_load(&A.num) >= A.mem && intern_grow() == MEM_ERROR) goto fail;
+
+    a = (struct atom*)malloc(sizeof(struct atom));
+    if (a == NULL) goto fail;
+
+    a->chars = line->chars;
+    a->length = line->length;
+    a->refs = 1;
+    a->hash = h;
+    a->seen = 0;
+    a->next = A.text[h & (A.mem - 1)];
+    A.text[h & (A.mem - 1)] = a;
+    a->anext = A.addr[addr_slot(a->chars, A.mem)];
+    A.addr[addr_slot(a->chars, A.mem)] = a;
+    atomic_fetch_add(&A.num, 1);
+  }
+  pthread_mutex_unlock(&A.lock);
 
-    *lines = tmp;
+  if (old != NULL) line_free(old);
+  return 0;
 
-    return size;
+fail:
+  pthread_mutex_unlock(&A.lock);
+  return MEM_ERROR;
 }
 
-void set_name(char *filename)
+/* drops a line's share of chars. Returns 1 while other lines still
+   share it, 0 when the storage is the caller's to free */
+int atom_release(char *chars)
 {
-  free(E.filename);
-  E.filename = strdup(filename);
-}
+  struct atom **p;
+  struct atom *a;
 
-int e_read(char *filename)
-{
-  FILE *fp = fopen(filename, "r");
-  if (fp == NULL) 
+  if (atomic_load(&A.num) == 0) return 0;
+
+  pthread_mutex_lock(&A.lock);
+  a = atom_of(chars);
+  if (a == NULL || --a->refs > 0)
   {
-    fp = fopen(filename, "w");
-    if (fp == NULL)
-    {
-  	 printf("failed to open file\n");
-  	 return -1;
-    }
+    pthread_mutex_unlock(&A.lock);
+    return a != NULL;
   }
 
-  T.num = read_file(fp, &T.lines);
-
-  fclose(fp);
+  for (p = &A.text[a->hash & (A.mem - 1)]; *p != a; p = &(*p)->next);
+  *p = a->next;
+  for (p = &A.addr[addr_slot(chars, A.mem)]; *p != a; p = &(*p)->anext);
+  *p = a->anext;
+  atomic_fetch_sub(&A.num, 1);
+  pthread_mutex_unlock(&A.lock);
 
+  free(a);
   return 0;
 }
 
-int e_open(char *filename)
+int interned(char *chars)
 {
-  if (!e_read(filename))
-    set_name(filename);
-  else return -1;
+  struct atom *a;
 
-  return 0;
+  if (atomic_load(&A.num) == 0) return 0;
+
+  pthread_mutex_lock(&A.lock);
+  a = atom_of(chars);
+  pthread_mutex_unlock(&A.lock);
+
+  return a != NULL;
 }
 
-int e_write(char *filename)
+/* interns lines from..to of t */
+int text_intern(struct text *t, int from, int to)
 {
-  if (filename == NULL)
-  {
-    if (E.filename == NULL)
-    {
-      printf("file name is not associated\n");
-      return 1;
-    }
-    else
-      filename = E.filename;
-  }
-  else if (E.filename == NULL)
-    set_name(filename);
+  str *line;
+  int j;
 
-  FILE *f = fopen(filename, "w");
-  if (f == NULL)
+  for (j = from; j < to; j++)
   {
-    printf("failed to open file\n");
-    return 1;
+    line = line_mut(t, j);
+    if (line == NULL || line_intern(line) == MEM_ERROR) return MEM_ERROR;
   }
 
-  buffer buf = NEWBUF;
+  return 0;
+}
+
+/* the lines of T, their bytes with newlines, and the bytes they take
+   counting each atom once */
+/* what interning saves on the bytes of T; without a line interned
+   there is nothing to walk */
+void intern_stats(long bytes)
+{
+  struct atom *a;
+  str *line;
+  long stored = 0;
+  long seen;
+  int shared = 0;
+  int copies = 0;
   int j;
-  
-  for (j = 0; j < T.num; j++)
+
+  if (atomic_load(&A.num) == 0)
   {
-    append(&buf, T.lines[j].chars, T.lines[j].length);
-    if (j != T.num - 1) append(&buf, "\n", 1);
+    fprintf(output(), "interned lines: 0 in 0 copies, bytes stored: %ld, dedup ratio: %.2f\n",
+            bytes, 1.0);
+    return;
   }
 
-  if ((int)fwrite(buf.chars, sizeof(char), buf.len, f) != buf.len)
+  pthread_mutex_lock(&A.lock);
+  seen = ++A.seen;
+  pthread_mutex_unlock(&A.lock);
+
+  for (j = 0; j < T.num; j++)
   {
-    printf("failed to write\n");
-    return 1;
-  }
+    /* read first, unpacking a chunk may intern and take A.lock */
+    line = line_at(&T, j);
 
-  free(buf.chars);
+    pthread_mutex_lock(&A.lock);
+    a = atom_of(line->chars);
+    if (a == NULL)
+      stored += line->length + 1;
+    else
+    {
+      shared++;
+      if (a->seen != seen)
+      {
+        a->seen = seen;
+        copies++;
+        stored += line->length + 1;
+      }
+    }
+    pthread_mutex_unlock(&A.lock);
 
-  E.saved = 1;
-  return 0;
+    if ((j + 1) % CHUNK == 0)
+      squeeze_grown(&T);
+  }
+
+  fprintf(output(), "interned lines: %d in %d copies, bytes stored: %ld, dedup ratio: %.2f\n",
+          shared, copies, stored, stored > 0 ? (double)bytes / stored : 1.0);
 }
 
+/* COMPRESSION
+  ____________
+*/
 
+/* an LZ77 codec in the LZ4 block layout: a token byte holds the literal
+   count and the match length - LZ_MIN in its halves, 15 meaning more
+   follows in bytes of 255 (the last one below 255); then the literals,
+   a 2 byte offset back into the output and the rest of the match length.
+   The last sequence has literals only */
 
-/* SETTINGS 
-  _________
-*/
-void set_wrap(int k)
+#define LZ_MIN 4
+#define LZ_HASH 13
+#define LZ_WINDOW 65535
+
+int lz_bound(int n)
 {
-  E.wrap = k;
+  return n + n / 255 + 16;
 }
 
-void set_numbers(int k)
+int lz_length(unsigned char *dst, int n)
 {
-  E.numbers = k;
+  int k = 0;
+
+  for (; n >= 255; n -= 255)
+    dst[k++] = 255;
+  dst[k++] = n;
+
+  return k;
 }
 
-void set_tabwidth(int k)
+/* compresses the n bytes of src into dst, which has room for lz_bound(n),
+   and returns the size it took */
+int lz_pack(char *src, int n, char *dst)
 {
-  E.tabwidth = k;
-}
+  unsigned char *in = (unsigned char*)src;
+  unsigned char *o = (unsigned char*)dst;
+  unsigned char *token;
+  int table[1 << LZ_HASH];
+  uint32_t seq;
+  uint32_t h;
+  int anchor = 0;
+  int ref;
+  int len;
+  int lit;
+  int i = 0;
 
+  for (h = 0; h < (1 << LZ_HASH); h++)
+    table[h] = -1;
 
-/* EDITOR OPERATIONS
-  __________________
-*/
+  while (i + LZ_MIN <= n)
+  {
+    memcpy(&seq, in + i, sizeof(seq));
+    h = (seq * 2654435761u) >> (32 - LZ_HASH);
+    ref = table[h];
+    table[h] = i;
 
-int idxsubstr(str line, str tofind)
-{
-  int i;
-  int j;
-  int found;
+    if (ref < 0 || i - ref > LZ_WINDOW || memcmp(in + ref, in + i, LZ_MIN) != 0)
+    {
+      /* data that does not repeat is skipped over faster */
+      i += 1 + ((i - anchor) >> 6);
+      continue;
+    }
 
-  if (tofind.length < 1)
-  {
-    printf("invalid parameter\n");
-    return -1;
+    for (len = LZ_MIN; i + len < n && in[ref + len] == in[i + len]; len++);
+
+    lit = i - anchor;
+    token = o++;
+    *token = (lit >= 15 ? 15 : lit) << 4 | (len - LZ_MIN >= 15 ? 15 : len - LZ_MIN);
+    if (lit >= 15) o += lz_length(o, lit - 15);
+    memcpy(o, in + anchor, lit);
+    o += lit;
+
+    *o++ = (i - ref) & 255;
+    *o++ = (i - ref) >> 8;
+    if (len - LZ_MIN >= 15) o += lz_length(o, len - LZ_MIN - 15);
+
+    i += len;
+    anchor = i;
   }
 
-  for (i = 0; i <= line.length - tofind.length; i++)
+  lit = n - anchor;
+  *o++ = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15) o += lz_length(o, lit - 15);
+  memcpy(o, in + anchor, lit);
+  o += lit;
+
+  return o - (unsigned char*)dst;
+}
+
+/* expands the len bytes lz_pack wrote into the n bytes of dst, returns -1
+   unless they come out at exactly n */
+int lz_unpack(char *src, int len, char *dst, int n)
+{
+  unsigned char *in = (unsigned char*)src;
+  unsigned char *end = in + len;
+  unsigned char *o = (unsigned char*)dst;
+  int token;
+  int lit;
+  int mlen;
+  int off;
+  int pos = 0;
+  int c;
+
+  while (in < end)
   {
-    if (line.chars[i] == tofind.chars[0])
-    {
-      found = 1;
-      for (j = 1; j < tofind.length; j++)
+    token = *in++;
+
+    lit = token >> 4;
+    if (lit == 15)
+      do
       {
-        if (tofind.chars[j] != line.chars[i + j])
-        {
-          found = 0;
-          break;
-        }
-      }
-      if (found)
-        return i;
-    }
+        if (in >= end) return -1;
+        c = *in++;
+        lit += c;
+      } while (c == 255);
+
+    if (lit > end - in || lit > n - pos) return -1;
+    memcpy(o + pos, in, lit);
+    in += lit;
+    pos += lit;
+
+    if (in == end) break;
+
+    if (end - in < 2) return -1;
+    off = in[0] | in[1] << 8;
+    in += 2;
+
+    mlen = token & 15;
+    if (mlen == 15)
+      do
+      {
+        if (in >= end) return -1;
+        c = *in++;
+        mlen += c;
+      } while (c == 255);
+    mlen += LZ_MIN;
+
+    if (off == 0 || off > pos || mlen > n - pos) return -1;
+
+    /* the match may overlap what it copies */
+    for (c = 0; c < mlen; c++, pos++)
+      o[pos] = o[pos - off];
   }
 
-  return -1;
+  return pos == n ? 0 : -1;
 }
 
-int e_insert_after(str toin, int pos, struct arraystr *ar)
+/* packs the count lines of c into one compressed blob, freeing their
+   storage and descriptors. The caller makes sure no other thread or text
+   can reach c. When it does not compress c is marked dense and either
+   left as it is (-1) or, with keep, packed as it is for the page file */
+int chunk_pack(struct chunk *c, int count, int keep)
 {
-  int j;
-  int i;
-  int k = 0;
-  int idx = 0;
-  int strtoadd = 1;
-  str* newlines = NULL;
+  char *raw = NULL;
+  char *blob = NULL;
   char *tmp = NULL;
+  int rawlen = count * sizeof(int);
+  int len;
+  int j;
 
-  if (pos > ar->num || pos < 0) 
-    {
-      printf("out of bounds\n");
-      return -1;
-    }
+  /* read back from the page file or the file it came from and not
+     changed since: it is still there */
+  if (c->off >= 0 || c->src != NULL)
+  {
+    for (j = 0; j < count; j++)
+      line_free(c->lines[j].chars);
+    free(c->lines);
+    c->lines = NULL;
+    atomic_store(&c->packed, 1);
+    return 0;
+  }
 
-  for (j = 0; j < toin.length; j++)
-    if (toin.chars[j] == '\n')
-      strtoadd++;
+  for (j = 0; j < count; j++)
+    rawlen += c->lines[j].length;
 
-  newlines = malloc((ar->num + strtoadd)*sizeof(str));
-  if (newlines == NULL) return MEM_ERROR;
+  raw = (char*)malloc(rawlen);
+  blob = (char*)malloc(lz_bound(rawlen));
+  if (raw == NULL || blob == NULL)
+  {
+    free(raw);
+    free(blob);
+    return MEM_ERROR;
+  }
 
-  for (j = 0; j < pos; j++)
+  /* the lengths first, then the bytes of every line back to back */
+  len = count * sizeof(int);
+  for (j = 0; j < count; j++)
   {
-    newlines[idx++] = ar->lines[j];
+    memcpy(raw + j * sizeof(int), &c->lines[j].length, sizeof(int));
+    memcpy(raw + len, c->lines[j].chars, c->lines[j].length);
+    len += c->lines[j].length;
   }
 
-  tmp = malloc(toin.length);
-  if (tmp == NULL) return MEM_ERROR;
+  len = lz_pack(raw, rawlen, blob);
 
-  for (i = 0; i <= toin.length; i++)
+  /* below 3/4 it is not worth the time it takes to unpack. A blob kept
+     as it is has size == rawlen, a compressed one is always smaller */
+  if (len > rawlen / 4 * 3)
   {
-    if (toin.chars[i] == '\n' || i == toin.length)
+    c->dense = 1;
+    if (!keep)
     {
-      tmp[k] = '\0';
-      tmp = realloc(tmp, k + 1);
-      if (tmp == NULL) return MEM_ERROR;
-
-      newlines[idx].chars = tmp;
-      newlines[idx++].length = k;
-
-      k = 0;
-      tmp = malloc(toin.length);
-      if (tmp == NULL) return MEM_ERROR;
+      free(raw);
+      free(blob);
+      return -1;
     }
-    else
-      tmp[k++] = toin.chars[i];
+    free(blob);
+    blob = raw;
+    len = rawlen;
   }
-
-  for(; j < ar->num; j++)
+  else
   {
-    newlines[idx++] = ar->lines[j];
+    free(raw);
+    tmp = (char*)realloc(blob, len);
+    if (tmp != NULL) blob = tmp;
   }
 
-  if (ar->lines != NULL)
-    free(ar->lines);
-
-  ar->lines = newlines;
-  ar->num += strtoadd;
+  for (j = 0; j < count; j++)
+    line_free(c->lines[j].chars);
+  free(c->lines);
+  c->lines = NULL;
 
-  E.saved = 0;
-  return strtoadd;
+  c->blob = blob;
+  c->size = len;
+  c->count = count;
+  c->rawlen = rawlen;
+  atomic_store(&c->packed, 1);
+  return 0;
 }
 
-int e_replace_substr(int start, int end, str tofind, str toreplace)
+/* gives the lines of a packed chunk storage of their own again, reading
+   it back from the page file first if it was spilled; any thread reading
+   the chunk may do this */
+void chunk_unpack(struct chunk *c)
 {
+  char *raw = NULL;
+  int pos;
   int j;
-  int i;
-  int idx;
-  int index;
-  int added;
-  char *tmp = NULL;
-  str toin;
-
 
-  if (start < 1 || start > T.num || end < 1 || end > T.num)
+  pthread_mutex_lock(&K.lock);
+  if (!atomic_load(&c->packed))
   {
-    printf("out of bounds\n");
-    return -1;
+    pthread_mutex_unlock(&K.lock);
+    return;
   }
 
-  for (j = start - 1; j < end;)
+  if (c->blob == NULL && c->off < 0)
   {
-    if (tofind.length <= 1 && tofind.chars[0] == '^')
-    {
-      index = 0;
-      tofind.length = 0;
-    }
-    else if (tofind.length <= 1 && tofind.chars[0] == '$')
-    {
-      index = T.lines[j].length;
-      tofind.length = 0;
-    }
-    else
-      index = idxsubstr(T.lines[j], tofind);
+    if (source_read(c) < 0) goto fail;
+    atomic_store(&c->packed, 0);
+    pthread_mutex_unlock(&K.lock);
+    return;
+  }
+  if (c->blob == NULL && chunk_fetch(c) < 0) goto fail;
 
-    if (index != -1)
-    {
-      idx = 0;
-      tmp = (char*)malloc(T.lines[j].length - tofind.length + toreplace.length + 1);
-      if (tmp == NULL) return MEM_ERROR;
+  if (c->size == c->rawlen)
+  {
+    raw = c->blob;
+    c->blob = NULL;
+  }
+  else
+  {
+    raw = (char*)malloc(c->rawlen);
+    if (raw == NULL || lz_unpack(c->blob, c->size, raw, c->rawlen) < 0)
+      goto fail;
+  }
 
-      for (i = 0; i < index; i++)
-      {
-        tmp[idx++] = T.lines[j].chars[i];
-      }
-      for (i = 0; i < toreplace.length; i++)
-      {
-        tmp[idx++] = toreplace.chars[i];
-      }
-      for (i = index + tofind.length; i < T.lines[j].length; i++)
-      {
-        tmp[idx++] = T.lines[j].chars[i];
-      }
-      tmp[idx] = '\0';
+  c->lines = (str*)malloc(CHUNK * sizeof(str));
+  if (c->lines == NULL) goto fail;
+  atomic_fetch_add(&K.grown, c->rawlen + CHUNK * sizeof(str));
 
-      toin.chars = tmp;
-      toin.length = T.lines[j].length - tofind.length + toreplace.length;
+  pos = c->count * sizeof(int);
+  for (j = 0; j < c->count; j++)
+  {
+    memcpy(&c->lines[j].length, raw + j * sizeof(int), sizeof(int));
+    c->lines[j].chars = (char*)malloc(c->lines[j].length + 1);
+    if (c->lines[j].chars == NULL) goto fail;
 
-      e_delr(j+1, j+1);
-      added = e_insert_after(toin, j, &T);
+    memcpy(c->lines[j].chars, raw + pos, c->lines[j].length);
+    c->lines[j].chars[c->lines[j].length] = '\0';
+    pos += c->lines[j].length;
 
-      free(toin.chars);
-      j += added;
-      end += (added - 1);
-    }
-    else j++;
+    /* left with storage of its own if that fails */
+    if (E.intern) line_intern(&c->lines[j]);
   }
 
-  return 0;
+  free(raw);
+  free(c->blob);
+  c->blob = NULL;
+  atomic_store(&c->packed, 0);
+  pthread_mutex_unlock(&K.lock);
+  return;
+
+fail:
+  /* no line of the chunk can be handed out, there is no going on */
+  fprintf(stderr, "failed to bring back lines %s\n", c->blob == NULL && c->off >= 0 ? "from the page file" : "into memory");
+  abort();
 }
 
-int e_insert_symbol(str *line, char c, int pos)
+/* PAGING
+  ________
+*/
+
+/* when packing alone does not bring a text under its budget, the packed
+   chunks read longest ago go out to a page file: an unlinked temp file
+   shared by all documents, written under K.lock. A chunk read back keeps
+   its place there until it changes, so going cold again costs nothing.
+   One changed or dropped punches a hole where it was, and the file starts
+   over empty once nothing is out in it */
+
+int spill_open()
 {
-  char *tmp = NULL;
-  int j;
+  char path[PATH_MAX];
+  char *dir = getenv("TMPDIR");
 
-  if (pos < 0) pos = 0;
-  if (pos > line->length) pos = line->length;
+  if (K.fd >= 0) return 0;
 
-  tmp = malloc(line->length + 2);
-  if (tmp == NULL) return MEM_ERROR;
+  snprintf(path, sizeof(path), "%s/editor-XXXXXX", dir != NULL && *dir ? dir : "/tmp");
+  K.fd = mkstemp(path);
+  if (K.fd < 0) return -1;
+  unlink(path);
 
-  for (j = line->length; j >= pos; j--)
-  {
-    tmp[j] = line->chars[j - 1];
-  }
+  return 0;
+}
 
-  tmp[j--] = c;
+/* moves the blob of packed chunk c to the page file */
+int chunk_spill(struct chunk *c)
+{
+  ssize_t n;
+  int done = 0;
 
-  while (j >= 0)
+  pthread_mutex_lock(&K.lock);
+  if (spill_open() < 0)
   {
-    tmp[j] = line->chars[j];
-    j--;
+    pthread_mutex_unlock(&K.lock);
+    return -1;
   }
 
-  tmp[line->length + 1] = '\0';
-  free(line->chars);
-  line->chars = tmp;
-  line->length += 1;
+  while (done < c->size)
+  {
+    n = pwrite(K.fd, c->blob + done, c->size - done, K.end + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+    {
+      /* the disk is full, c stays in memory */
+      pthread_mutex_unlock(&K.lock);
+      return -1;
+    }
+    done += n;
+  }
 
-  E.saved = 0;
+  c->off = K.end;
+  K.end += c->size;
+  K.spilled++;
+  free(c->blob);
+  c->blob = NULL;
+  pthread_mutex_unlock(&K.lock);
 
   return 0;
 }
 
-int e_edit(str *line, char c, int pos)
+/* gives the space of spilled chunk c back, under K.lock */
+void spill_free(struct chunk *c)
 {
+  fallocate(K.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, c->off, c->size);
+  c->off = -1;
 
-  if (line->length < pos - 1 || pos < 1)
+  if (--K.spilled == 0)
   {
-    printf("out of bounds\n");
-    return -1;
+    ftruncate(K.fd, 0);
+    K.end = 0;
   }
+}
 
-  line->chars[pos - 1] = c;
+/* reads the blob of spilled chunk c into to, under K.lock */
+int spill_read(struct chunk *c, char *to)
+{
+  ssize_t n;
+  int done = 0;
 
-  E.saved = 0;
+  while (done < c->size)
+  {
+    n = pread(K.fd, to + done, c->size - done, c->off + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    done += n;
+  }
 
   return 0;
 }
 
-int e_delr(int start, int end)
-{ 
-  int j;
-  int idx = 0;
-  int len;
-  str *tmp = NULL;
-
-  start = start < 1 ? 0 : start - 1;
-  end = end > T.num ? T.num : end;
-
-  len = (T.num - (end - start));
-
-  tmp = (str*)malloc(len*sizeof(str));
-  if (tmp == NULL) return MEM_ERROR;
+/* reads the blob of spilled chunk c back, under K.lock; the copy on
+   disk stays */
+int chunk_fetch(struct chunk *c)
+{
+  c->blob = (char*)malloc(c->size);
+  if (c->blob == NULL) return MEM_ERROR;
 
-  for (j = 0; j < T.num; j++)
+  if (spill_read(c, c->blob) < 0)
   {
-    while (j >= start && j < end)
-    {
-      free(T.lines[j++].chars);
-    }
-    tmp[idx++] = T.lines[j];
+    free(c->blob);
+    c->blob = NULL;
+    return -1;
   }
 
-  free(T.lines);
-  T.lines = tmp;
-  T.num = len;
-
-  E.saved = 0;
   return 0;
 }
 
-int e_delcom(int mode)
+/* what packed chunk c holds, for a reader that leaves c as it is: the
+   lengths and bytes of its blob, or the bytes of its file, returned in
+   a copy of their own with their length. Under K.lock */
+int chunk_copy(struct chunk *c, char **out)
 {
-  //1 pascal 2 shell 3 c 4 c++
-  int j;
-  int i;
-  int quotes = 0;
-  char *tmp = NULL;
-  struct buffer buf;
-  buf.chars = NULL;
-  buf.len = 0;
-  buf.mem = 0;
+  char *raw = (char*)malloc(c->rawlen > 0 ? c->rawlen : 1);
+  char *blob = c->blob;
+  ssize_t n;
+  int got = 0;
 
-  for (j = 0; j < T.num; j++)
+  if (raw == NULL) return MEM_ERROR;
+
+  if (c->blob == NULL && c->off < 0)
   {
-    for (i = 0; i < T.lines[j].length - 1; i++)
+    while (got < c->rawlen)
     {
-      if ((mode <= 2 && T.lines[j].chars[i] == '\'') || (mode >= 2 && T.lines[j].chars[i] == '\"'))
-        quotes = quotes ? 0 : 1;
-      if (!quotes)
-      {
-        if ((mode == 4 && T.lines[j].chars[i] == '/' && T.lines[j].chars[i + 1] == '/')
-           || (mode == 2 && T.lines[j].chars[i] == '#'))
-        {
-          tmp = (char*)realloc(T.lines[j].chars, i + 1);
-          if (tmp == NULL) return MEM_ERROR;
-
-          tmp[i] = '\0';
-          T.lines[j].chars = tmp;
-          T.lines[j].length = i;
-
-          break;
-        }
-        else if (((mode == 1 && T.lines[j].chars[i] == '(') || (mode == 3 && T.lines[j].chars[i] == '/')) 
-                  && T.lines[j].chars[i + 1] == '*')
-        {
-          int rows;
-          int broke = 0;
-          int start = i;
-          for (rows = 0; j + rows < T.num; rows++)
-          {
-            while (i < T.lines[j + rows].length - 1)
-            {
-              if (T.lines[j + rows].chars[i] == '*' && ((mode == 1 && T.lines[j + rows].chars[i + 1] == ')')
-                  || (mode == 3 && T.lines[j + rows].chars[i + 1] == '/')))
-              {
-                broke = 1;
-                break;
-              }
-              i++;
-            }
-            if (broke) break;
-            i = 0;
-          }
+      n = pread(c->src->fd, raw + got, c->rawlen - got, c->at + got);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      got += n;
+    }
+    *out = raw;
+    return got;
+  }
 
-          if (rows == 0)
-          {
-            append(&buf, T.lines[j].chars, start);
-            append(&buf, &T.lines[j].chars[i + 2], T.lines[j].length - i - 2);
-            append(&buf, "\0", 1);
+  if (blob == NULL && ((blob = (char*)malloc(c->size)) == NULL || spill_read(c, blob) < 0))
+    goto fail;
 
-            tmp = (char*)realloc(buf.chars, buf.len);
-            if (tmp == NULL) return MEM_ERROR;
+  if (c->size == c->rawlen)
+    memcpy(raw, blob, c->rawlen);
+  else if (lz_unpack(blob, c->size, raw, c->rawlen) < 0)
+    goto fail;
 
-            free(T.lines[j].chars);
-            T.lines[j].chars = tmp;
-            T.lines[j].length = buf.len - 1;
+  if (blob != c->blob) free(blob);
+  *out = raw;
+  return c->rawlen;
 
-            buf.chars = NULL;
-            buf.len = 0;
-            buf.mem = 0;
-          }
-          else
-          {
-            tmp = (char*)realloc(T.lines[j].chars, start + 1);
-            if (tmp == NULL) return MEM_ERROR;
+fail:
+  if (blob != c->blob) free(blob);
+  free(raw);
+  return -1;
+}
 
-            tmp[start] = '\0';
-            T.lines[j].chars = tmp;
-            T.lines[j].length = start;
-            
-            if (T.lines[j + rows].length > i + 2)
-              append(&buf, &T.lines[j + rows].chars[i + 2], T.lines[j + rows].length - i - 2);
-            append(&buf, "\0", 1);
-            tmp = (char*)realloc(buf.chars, buf.len);
-            if (tmp == NULL) return MEM_ERROR;
+/* TEXT
+  ______
+*/
 
-            T.lines[j + rows].chars = tmp;
-            T.lines[j + rows].length = buf.len - 1;
-            i = 0;
+/* the chunk asked for last on this thread, a walk through the lines
+   finds the next one there or right after it */
+_Thread_local int hint = 0;
 
+/* the chunk line j is in. No chunk holds more than CHUNK lines, so it
+   is not before chunk j / CHUNK, where it is while none was edited */
+int chunk_of(struct table *tab, int j)
+{
+  int lo = j / CHUNK;
+  int hi = tab->n - 1;
+  int mid;
 
-            buf.chars = NULL;
-            buf.len = 0;
-            buf.mem = 0;
-            
-            if (rows > 1)
-              e_delr(j + 2, j + 1 + rows);
-          }
-        }
+  if (hint >= lo && hint < tab->n && tab->start[hint] <= j)
+  {
+    if (j < tab->start[hint + 1]) return hint;
+    if (hint + 1 < tab->n && j < tab->start[hint + 2]) return ++hint;
+  }
+  if (lo > hi) lo = hi;
+  if (j < tab->start[lo + 1]) return hint = lo;
 
-      }
-    }
+  while (lo < hi)
+  {
+    mid = (lo + hi + 1) / 2;
+    if (tab->start[mid] <= j)
+      lo = mid;
+    else
+      hi = mid - 1;
   }
-  return 0;
+  return hint = lo;
 }
 
-void e_help()
+str *line_at(struct text *t, int j)
 {
-  int w = E.wrap;
-  int n = E.numbers;
-  int t = E.tabwidth;
-  E.wrap = 0;
-  E.numbers = 0;
-  E.tabwidth = 4;
+  int k = chunk_of(t->tab, j);
+  struct chunk *c = t->tab->chunks[k];
+  long tick = atomic_load_explicit(&K.tick, memory_order_relaxed);
 
-  print(1, ahelp.num, &ahelp);
+  if (atomic_load_explicit(&c->packed, memory_order_acquire))
+    chunk_unpack(c);
+  if (atomic_load_explicit(&c->used, memory_order_relaxed) != tick)
+    atomic_store_explicit(&c->used, tick, memory_order_relaxed);
 
-  E.wrap = w;
-  E.numbers = n;
-  E.tabwidth = t;
+  return &c->lines[j - t->tab->start[k]];
 }
 
-/* PRINT 
-  ____________
-*/
-
-int itoa(buffer *buf, int n)
+struct chunk *chunk_new()
 {
-  char *res;
-  int length = 1;
-  int i;
-  int del = 10;
-  char swap;
-
-  while (n / del > 0) 
+  struct chunk *c = (struct chunk*)malloc(sizeof(struct chunk));
+
+  if (c == NULL) return NULL;
+
+  atomic_init(&c->refs, 1);
+  atomic_init(&c->packed, 0);
+  atomic_init(&c->used, atomic_load(&K.tick));
+  c->bytes = -1;
+  c->dense = 0;
+  c->count = 0;
+  c->blob = NULL;
+  c->off = -1;
+  c->src = NULL;
+  c->summed = 0;
+
+  c->lines = (str*)malloc(CHUNK * sizeof(str));
+  if (c->lines == NULL)
   {
-    length++;
-    del *= 10;
+    free(c);
+    return NULL;
   }
+  return c;
+}
 
-  res = malloc(length);
-
-  del = 1;
-  for (i = 0; i < length; i++)
+void chunk_drop(struct chunk *c)
+{
+  if (atomic_fetch_sub(&c->refs, 1) == 1)
   {
-    res[i] = ((n / del) % 10) + '0';
-    del *= 10;
+    if (c->off >= 0)
+    {
+      pthread_mutex_lock(&K.lock);
+      spill_free(c);
+      pthread_mutex_unlock(&K.lock);
+    }
+    if (c->src != NULL) source_drop(c->src);
+    free(c->blob);
+    free(c->lines);
+    free(c);
   }
+}
+
+void table_drop(struct table *tab)
+{
+  int c;
+
+  if (tab == NULL || atomic_fetch_sub(&tab->refs, 1) != 1) return;
 
-  for (i = 0; i < length / 2; i++)
+  for (c = 0; c < tab->n; c++)
+    chunk_drop(tab->chunks[c]);
+  free(tab->chunks);
+  free(tab->start);
+  free(tab);
+}
+
+struct table *table_new(int mem)
+{
+  struct table *tab = (struct table*)malloc(sizeof(struct table));
+
+  if (tab == NULL) return NULL;
+
+  tab->mem = mem < BUFFADD ? BUFFADD : mem;
+  tab->chunks = (struct chunk**)malloc(tab->mem * sizeof(struct chunk*));
+  tab->start = (int*)malloc((tab->mem + 1) * sizeof(int));
+  if (tab->chunks == NULL || tab->start == NULL)
   {
-    swap = res[length - 1 - i];
-    res[length - 1 - i] = res[i];
-    res[i] = swap;
+    free(tab->chunks);
+    free(tab->start);
+    free(tab);
+    return NULL;
   }
 
-  for (i = length; i < E.blank - 1; i++)
-    append(buf, " ", 1);
-  append(buf, res, length);
-  append(buf, " ", 1);
-  free(res);
-  return 0;
+  atomic_init(&tab->refs, 1);
+  tab->n = 0;
+  tab->start[0] = 0;
+  return tab;
 }
 
-ssize_t line_insert_tabs(char** line, str current)
+/* gives t a table of its own, still sharing the chunks */
+int table_own(struct text *t)
 {
-  int tabs = 0;
-  size_t idx = 0;
-  int j;
-  char *l;
+  struct table *tab;
+  int c;
 
-  for (j = 0; j < current.length; j++)
-    if (current.chars[j] == '\t') tabs++;
+  if (t->tab != NULL && atomic_load(&t->tab->refs) == 1) return 0;
 
-  l = malloc(current.length + tabs*(E.tabwidth - 1) + 1);
-  if (l == NULL) return MEM_ERROR;
+  tab = table_new(t->tab == NULL ? 0 : t->tab->n);
+  if (tab == NULL) return MEM_ERROR;
 
-  for (j = 0; j < current.length; j++)
+  for (c = 0; t->tab != NULL && c < t->tab->n; c++)
   {
-    if (current.chars[j] == '\t')
-    {
-      l[idx++] = ' ';
-      while (idx % E.tabwidth != 0) l[idx++] = ' ';
-    }
-    else
-    {
-      l[idx++] = current.chars[j];
-    }
+    tab->chunks[c] = t->tab->chunks[c];
+    tab->start[c + 1] = t->tab->start[c + 1];
+    atomic_fetch_add(&tab->chunks[c]->refs, 1);
   }
+  tab->n = c;
 
-  *line = l;
-  return idx;
+  table_drop(t->tab);
+  t->tab = tab;
+  return 0;
 }
 
-struct pagesInfo
+/* line j of t in a chunk t does not share, for changing it in place */
+str *line_mut(struct text *t, int j)
 {
-  int index;
-  int offset;
-  int x;
-  int pindex;
-  int of;
-  int bound;
-  int max;
-};
+  struct chunk *old;
+  struct chunk *c;
+  int k;
 
-int page(struct pagesInfo *I, struct arraystr *ar)
-{
-  int width;
-  int rlen;
-  char *rend;
+  if (table_own(t) == MEM_ERROR) return NULL;
+
+  line_at(t, j);
+  k = chunk_of(t->tab, j);
+  old = t->tab->chunks[k];
+  if (atomic_load(&old->refs) > 1)
+  {
+    c = chunk_new();
+    if (c == NULL) return NULL;
+
+    memcpy(c->lines, old->lines, old->count * sizeof(str));
+    c->count = old->count;
+    t->tab->chunks[k] = c;
+    chunk_drop(old);
+  }
+
+  /* its size is counted again and it may compress now, the copy in the
+     page file or the file it was read from is out of date */
+  c = t->tab->chunks[k];
+  c->bytes = -1;
+  c->dense = 0;
+  c->summed = 0;
+  if (c->off >= 0)
+  {
+    pthread_mutex_lock(&K.lock);
+    spill_free(c);
+    pthread_mutex_unlock(&K.lock);
+  }
+  if (c->src != NULL)
+  {
+    source_drop(c->src);
+    c->src = NULL;
+  }
+  return &c->lines[j - t->tab->start[k]];
+}
 
+/* replaces lines pos..pos+del of t by the nin lines of in. Descriptors
+   change hands, no line is freed. Only the chunks the replaced lines are
+   in are laid out again, with the lines around them there, in as many
+   chunks as that takes; a few lines left over join a neighbour. Every
+   other chunk stays shared, and so does everything but the replaced
+   lines when nin == del */
+int text_splice(struct text *t, int pos, int del, str *in, int nin)
+{
+  struct chunk **fresh = NULL;
+  struct chunk **tmp = NULL;
+  struct table *tab;
+  int *stmp = NULL;
+  str *line;
+  int a = 0;
+  int b = 0;
+  int from;
+  int m;
+  int q;
+  int n;
+  int i;
   int j;
   int k;
-  int idx;
-  int numrows;
 
-  struct buffer buf;
-  int rows = 0;
-  
-  buf.chars = NULL;
-  buf.len = 0;
-  buf.mem = 0;
+  if (nin == del)
+  {
+    for (j = 0; j < nin; j++)
+    {
+      if ((line = line_mut(t, pos + j)) == NULL) return MEM_ERROR;
+      *line = in[j];
+    }
+    return 0;
+  }
 
-  width = (E.numbers || E.wrap) ? E.width - E.blank : E.width;
-  I->max = 0;
+  if (table_own(t) == MEM_ERROR) return MEM_ERROR;
+  tab = t->tab;
 
-  if (I->of)
+  /* chunks a..b hold the replaced lines, or the place they go */
+  if (tab->n > 0)
   {
-    I->index = I->pindex;
+    a = chunk_of(tab, pos < t->num ? pos : t->num - 1);
+    b = del > 0 ? chunk_of(tab, pos + del - 1) + 1 : a + 1;
+    if (pos == t->num && tab->chunks[a]->count == CHUNK) a = b = tab->n;
   }
-  
+  m = tab->start[b] - tab->start[a] - del + nin;
+  if (m > 0 && m < CHUNK / 2 && b < tab->n && m + tab->chunks[b]->count <= CHUNK)
+    m += tab->chunks[b++]->count;
+  else if (m > 0 && m < CHUNK / 2 && a > 0 && m + tab->chunks[a - 1]->count <= CHUNK)
+    m += tab->chunks[--a]->count;
 
-  if (I->index != 0 || I->of == 1) append(&buf, "\x1b[H", 3); //move to 1,1
-  I->pindex = I->index;
-  I->of = 0;
+  from = tab->start[a];
+  q = (m + CHUNK - 1) / CHUNK;
+  n = tab->n - (b - a) + q;
 
-  while (rows < E.height)
+  if (n > tab->mem)
   {
-    if (I->index == I->bound) 
+    tmp = (struct chunk**)realloc(tab->chunks, 2 * n * sizeof(struct chunk*));
+    if (tmp == NULL) return MEM_ERROR;
+    tab->chunks = tmp;
+    stmp = (int*)realloc(tab->start, (2 * n + 1) * sizeof(int));
+    if (stmp == NULL) return MEM_ERROR;
+    tab->start = stmp;
+    tab->mem = 2 * n;
+  }
+
+  fresh = (struct chunk**)malloc((q ? q : 1) * sizeof(struct chunk*));
+  if (fresh == NULL) return MEM_ERROR;
+
+  /* the lines are spread evenly, so no chunk is left with a handful, but
+     at the end, where the text grows, they fill the chunks up */
+  for (i = 0, j = 0; i < q; i++)
+  {
+    fresh[i] = chunk_new();
+    if (fresh[i] == NULL)
     {
-      if (rows == 0) return 0;
-      while (rows++ < E.height)
-      {
-        append(&buf, "\x1b[K\n", 4);
-      }
-      break;
+      while (i-- > 0)
+        chunk_drop(fresh[i]);
+      free(fresh);
+      return MEM_ERROR;
     }
 
-    if (I->x != 0)
+    if (b == tab->n)
+      fresh[i]->count = i < q - 1 ? CHUNK : m - i * CHUNK;
+    else
+      fresh[i]->count = m / q + (i < m % q);
+    for (k = 0; k < fresh[i]->count; k++, j++)
     {
-      for (k = 0; k < E.blank - 3; k++) append(&buf, " ", 1);
-      append(&buf, "-> ", 3);
+      if (from + j < pos)
+        line = line_at(t, from + j);
+      else if (from + j < pos + nin)
+        line = &in[from + j - pos];
+      else
+        line = line_at(t, from + j - nin + del);
+      fresh[i]->lines[k] = *line;
     }
-    else if (E.numbers) itoa(&buf, I->index + 1);
-    else if (E.wrap) for (k = 0; k < E.blank; k++) append(&buf, " ", 1);
-
+  }
 
-    if (!E.wrap)
-    {
-      rlen = line_insert_tabs(&rend, ar->lines[I->index]);
-      if (rlen == MEM_ERROR) return MEM_ERROR;
-      
-      rlen -= I->offset;
-      if (rlen < 0) rlen = 0;
-      if (rlen > width) rlen = width;
+  for (i = a; i < b; i++)
+    chunk_drop(tab->chunks[i]);
+  memmove(&tab->chunks[a + q], &tab->chunks[b], (tab->n - b) * sizeof(struct chunk*));
+  memcpy(&tab->chunks[a], fresh, q * sizeof(struct chunk*));
+  free(fresh);
 
-      append(&buf, &rend[I->offset], rlen);
-      if (I->max < ar->lines[I->index].length) I->max = ar->lines[I->index].length;
+  tab->n = n;
+  for (i = a; i < n; i++)
+    tab->start[i + 1] = tab->start[i] + tab->chunks[i]->count;
+  t->num = tab->start[n];
+  return 0;
+}
 
-      free(rend);
-    }
-    else
-    {
-      idx = 5;
-      numrows = 1;
-      j = 0;
+/* copies the descriptors of lines from..to of t into out */
+int text_flat(struct text *t, int from, int to, struct arraystr *out)
+{
+  int j;
 
-      if (I->x > 0)
-      {
-        j = I->x;
-        I->x = 0;
-      }
+  out->lines = (str*)malloc((to > from ? to - from : 1) * sizeof(str));
+  if (out->lines == NULL) return MEM_ERROR;
 
-      while (j < ar->lines[I->index].length)
-      {
-        if (idx == numrows*(width + 6) - 1)
-        {
-          rows++;
-          if (rows == E.height)
-          {
-            I->x = j - 1;
-            I->index--;
-            break;
-          }
+  for (j = from; j < to; j++)
+    out->lines[j - from] = *line_at(t, j);
+  out->num = to - from;
 
-          append(&buf, "\n", 1);
-          for (k = 0; k < E.blank - 3; k++)
-            append(&buf, " ", 1);
-          append(&buf, "-> ", 3);
-          idx += E.blank + 1;
-          numrows++;
-          
-        }
-        else if (ar->lines[I->index].chars[j] == '\t')
-        {
-          do 
-          {
-            append(&buf, " ", 1);
-            idx++;
-            if (idx - numrows*(width + 6) > width)
-            {
-              j++;
-              break;
-            }
-          } while (idx % E.tabwidth != 0);
-          j++;
-        }
-        else
-        {
-          append(&buf, &ar->lines[I->index].chars[j++], 1);
-          idx++;
-        } 
-      }
-    }
+  return 0;
+}
 
-    append(&buf, "\x1b[K\n", 4);
-    I->index++;
-    rows++;
-  }
+/* moves the lines of in into t after line pos, leaving in empty */
+int text_insert(struct text *t, int pos, struct arraystr *in)
+{
+  if (text_splice(t, pos, 0, in->lines, in->num) == MEM_ERROR) return MEM_ERROR;
 
-  write(STDIN_FILENO, buf.chars, buf.len);
-  free(buf.chars);
-  return 1;
+  free(in->lines);
+  in->lines = NULL;
+  in->num = 0;
+  return 0;
 }
 
+/* drops t's hold on its chunks, the line storage is not touched */
+void text_free(struct text *t)
+{
+  table_drop(t->tab);
+  t->tab = NULL;
+  t->num = 0;
+}
 
-int print(int start, int end, struct arraystr *ar) 
+/* text_free that also lets go of the line storage */
+void text_release(struct text *t)
 {
-  char c;
-  int printed;
+  struct chunk *c;
+  int k;
   int j;
 
-  I.index = start < 1 ? 0 : start - 1;
-  I.offset = 0;
-  I.x = 0;
-  I.pindex = 0;
-  I.of = 0;
-  I.bound = end > ar->num ? ar->num : end;
-  I.max = 0;
+  for (j = 0; j < t->num; j++)
+  {
+    k = chunk_of(t->tab, j);
+    c = t->tab->chunks[k];
 
-  page(&I, ar);
+    /* a packed chunk no one else holds has no line storage to free */
+    if (atomic_load(&c->packed) && atomic_load(&c->refs) == 1)
+    {
+      j = t->tab->start[k + 1] - 1;
+      continue;
+    }
+    line_free(line_at(t, j)->chars);
+  }
+  text_free(t);
+}
 
-  E.printing = 1;
+/* an O(1) handle on t as it is now: it shares t's table, which the
+   writer will copy before it changes anything, so readers of the
+   snapshot need no lock. Taken by the thread that edits t */
+int snapshot(struct text *t, struct text *s)
+{
+  long *tmp = NULL;
 
-  while (1) 
+  pthread_mutex_lock(&Z.lock);
+  if (Z.nlive == Z.mlive)
   {
-    enable_raw_mode();
-    read(STDIN_FILENO, &c, 1);
-    disable_raw_mode();
-
-    if (c == ' ')
+    tmp = (long*)realloc(Z.live, (Z.mlive + BUFFADD) * sizeof(long));
+    if (tmp == NULL)
     {
-      printed = page(&I, ar);
-      if (printed == MEM_ERROR) return MEM_ERROR;
-      if (printed == 0) 
-      {
-        write(STDOUT_FILENO, "\x1b[H", 3);
-        for (j = 0; j < E.height; j++)
-          write(STDOUT_FILENO, "\x1b[K\n", 4);
-        write(STDOUT_FILENO, "\x1b[H", 3);
-        break;
-      }
-      if (I.max - E.width + E.blank + 1 < I.offset)
-      {
-        I.offset = I.max - E.width + E.blank + 1;
-        I.of = 1;
-        page(&I, ar);
-      }
-
+      pthread_mutex_unlock(&Z.lock);
+      return MEM_ERROR;
     }
-    else if (c == 'q')
+    Z.live = tmp;
+    Z.mlive += BUFFADD;
+  }
+  *s = *t;
+  s->epoch = ++Z.now;
+  Z.live[Z.nlive++] = s->epoch;
+  pthread_mutex_unlock(&Z.lock);
+
+  if (s->tab != NULL)
+    atomic_fetch_add(&s->tab->refs, 1);
+  return 0;
+}
+
+/* drops a snapshot and frees the line storage no snapshot can read now */
+void snapshot_drop(struct text *s)
+{
+  long oldest = LONG_MAX;
+  int k;
+  int j;
+
+  text_free(s);
+
+  pthread_mutex_lock(&Z.lock);
+  for (k = 0; k < Z.nlive; k++)
+    if (Z.live[k] == s->epoch)
     {
-      write(STDOUT_FILENO, "\x1b[H", 3);
-      for (j = 0; j < E.height; j++)
-        write(STDOUT_FILENO, "\x1b[K\n", 4);
-      write(STDOUT_FILENO, "\x1b[H", 3);
+      Z.live[k] = Z.live[--Z.nlive];
       break;
     }
-    else if (c == '>' && E.wrap == 0 && I.max - E.width + E.blank >= I.offset)
-    {
-      I.offset++;
-      I.of = 1;
-      page(&I, ar);
-    }
-    else if (c == '<' && E.wrap == 0 && I.offset > 0)
-    {
-      I.offset--;
-      I.of = 1;
-      page(&I, ar);
-    }
-    c = 0;
+  for (k = 0; k < Z.nlive; k++)
+    if (Z.live[k] < oldest) oldest = Z.live[k];
+
+  /* stamps only grow, so what can go is at the front */
+  for (j = 0; j < Z.nlist && Z.list[j].stamp < oldest; j++)
+    free(Z.list[j].chars);
+  if (j > 0)
+  {
+    memmove(Z.list, &Z.list[j], (Z.nlist - j) * sizeof(struct retired));
+    Z.nlist -= j;
   }
+  pthread_mutex_unlock(&Z.lock);
 
-  E.printing = 0;
-  return 0;
+  s->epoch = 0;
 }
 
-void sighandler(int sig)
+/* a chunk squeeze may pack or spill, with the tick it was last read at */
+struct cold
 {
-  sig+=0;
-  get_window_size();
-  // if (E.printing)
-  // {
-  //   I.of = 1;
-  //   page(&I, &T);
-  // }
+  long used;
+  int k;
+};
+
+int cmp_cold(const void *a, const void *b)
+{
+  const struct cold *x = (const struct cold*)a;
+  const struct cold *y = (const struct cold*)b;
+
+  if (x->used != y->used) return x->used < y->used ? -1 : 1;
+  return x->k - y->k;
 }
 
+/* the memory chunk k of t takes: its lines and descriptors, or its blob */
+long chunk_size(struct text *t, int k)
+{
+  struct chunk *c = t->tab->chunks[k];
+  int j;
+
+  if (atomic_load(&c->packed))
+    return c->blob == NULL ? 0 : c->size;
 
-/*  COMMANDS
-   _________
- */
-int add_token(struct arraystr *ar, struct buffer *buf)
+  if (c->bytes < 0)
+  {
+    c->bytes = CHUNK * sizeof(str);
+    for (j = 0; j < c->count; j++)
+      c->bytes += c->lines[j].length + 1;
+  }
+  return c->bytes;
+}
+
+/* brings the memory t takes under E.budget: packs the chunks read
+   longest ago, and when that is not enough moves packed ones out to the
+   page file. Called between commands, when no one holds a line of t but
+   a snapshot or the undo record. The lines of chunks a snapshot reads
+   too stay as they are, but those already packed may still go out:
+   the save reads them under K.lock (see save_chunk) */
+void squeeze(struct text *t)
 {
-  str* tmp = NULL;
+  struct chunk *c;
+  struct cold *cold = NULL;
+  long total = 0;
+  long before;
+  long size;
+  int ncold = 0;
+  int lent;
+  int k;
+  int j;
 
-  append(buf, "\0", 1);
+  if (E.budget <= 0 || t->tab == NULL) return;
+  atomic_store(&K.grown, 0);
 
-  ar->num++;
-  tmp = (str*)realloc(ar->lines, (ar->num)* sizeof(str));
-  if (tmp == NULL) return MEM_ERROR;
+  for (k = 0; k < t->tab->n; k++)
+    total += chunk_size(t, k);
 
-  tmp[ar->num - 1].chars = buf->chars;
-  tmp[ar->num - 1].length = buf->len - 1;
+  if (total <= E.budget) return;
+  before = total;
 
-  ar->lines = tmp;
+  cold = (struct cold*)malloc(t->tab->n * sizeof(struct cold));
+  if (cold == NULL) return;
 
-  buf->chars = NULL;
-  buf->len = 0;
-  buf->mem = 0;
+  for (k = 0; k < t->tab->n; k++)
+  {
+    c = t->tab->chunks[k];
+    lent = atomic_load(&t->tab->refs) != 1 || atomic_load(&c->refs) != 1;
+    if ((lent && !atomic_load(&c->packed)) || (atomic_load(&c->packed) && c->blob == NULL))
+      continue;
+    if (t == &T && U.before != NULL && t->tab->start[k] < U.start + U.count && U.start < t->tab->start[k + 1])
+      continue;
+    /* a text that grows at the end would unpack its last chunk right away */
+    if (k == t->tab->n - 1 && c->count < CHUNK)
+      continue;
+    cold[ncold].used = atomic_load(&c->used);
+    cold[ncold++].k = k;
+  }
 
-  return 0;
+  qsort(cold, ncold, sizeof(struct cold), cmp_cold);
+
+  for (j = 0; j < ncold && total > E.budget; j++)
+  {
+    k = cold[j].k;
+    c = t->tab->chunks[k];
+    if (atomic_load(&c->packed) || (c->dense && c->off < 0)) continue;
+
+    size = chunk_size(t, k);
+    if (chunk_pack(c, c->count, 0) == 0)
+      total -= size - chunk_size(t, k);
+  }
+
+  for (j = 0; j < ncold && total > E.budget; j++)
+  {
+    k = cold[j].k;
+    c = t->tab->chunks[k];
+    size = chunk_size(t, k);
+
+    if (!atomic_load(&c->packed) && chunk_pack(c, c->count, 1) < 0) continue;
+    if (c->blob != NULL) chunk_spill(c);
+    total -= size - chunk_size(t, k);
+  }
+
+  /* the lines were small blocks all over the heap, hand the pages they
+     leave empty back once there are enough of them to be worth the walk */
+  if (atomic_fetch_add(&K.loose, before - total) + before - total > E.budget / 4)
+  {
+    atomic_store(&K.loose, 0);
+    malloc_trim(0);
+  }
+  free(cold);
 }
 
-int read_command(struct arraystr *ar)
+/* squeeze for loops that bring chunks in one after another: it walks
+   the whole text, so it only runs once what came into memory since the
+   last walk is a fair part of the budget */
+void squeeze_grown(struct text *t)
 {
-  struct buffer buf;
-  buf.chars = NULL;
-  buf.len = 0;
-  buf.mem = 0;
+  long step = E.budget / 8 > 16 * BLOCK ? E.budget / 8 : 16 * BLOCK;
 
-  char c;
-  int par = 0;
-  int parn = 0;
-  int trpar = 0;
+  if (E.budget > 0 && atomic_load(&K.grown) >= step)
+    squeeze(t);
+}
 
-  while (1)
+/* FILE I/O
+  _______________________
+*/
+/* grows ar a line at a time, mem is the capacity of ar->lines */
+int push_line(struct arraystr *ar, int *mem, char *s, int len)
+{
+  str *tmp = NULL;
+  char *line = NULL;
+
+  if (ar->num == *mem)
   {
-    c = fgetc(stdin);
+    *mem = *mem < BUFFADD ? BUFFADD : *mem * 2;
+    tmp = (str*)realloc(ar->lines, *mem * sizeof(str));
+    if (tmp == NULL) return MEM_ERROR;
+    ar->lines = tmp;
+  }
 
-    if (c == '\n')
-    {
-      if (!par)
-      {
-        if (buf.len > 0 || parn == 2) add_token(ar, &buf);
-        break;
-      }
-      else if (par && !trpar)
-      {
-        freear(ar);
-        printf("wrong input: parenthases\n");
-        return 1;
-      }
-      else if (trpar)
+  line = (char*)malloc(len + 1);
+  if (line == NULL) return MEM_ERROR;
+  memcpy(line, s, len);
+  line[len] = '\0';
+
+  ar->lines[ar->num].chars = line;
+  ar->lines[ar->num++].length = len;
+  return 0;
+}
+
+/* reads fd to the end a BLOCK at a time and appends its lines to ar,
+   each one allocated at its exact size; returns the number of lines added.
+   publish, if given, sees ar, the bytes read so far and arg after every
+   block, it may take the lines out of ar and stops the read by returning
+   nonzero */
+ssize_t read_lines(int fd, struct arraystr *ar, int (*publish)(struct arraystr*, long, void*), void *arg)
+{
+  buffer block = NEWBUF;
+  str *tmp = NULL;
+  char *nl;
+  int start = ar->num;
+  int mem = ar->num;
+  int scan = 0;
+  int from = 0;
+  long bytes = 0;
+  ssize_t n;
+
+  while (1)
+  {
+    if (reserve(&block, block.len + BLOCK) == MEM_ERROR) goto fail;
+
+    n = read(fd, &block.chars[block.len], block.mem - block.len);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue;
+      msg("failed to read file\n");
+      goto fail;
+    }
+    block.len += n;
+    bytes += n;
+
+    from = 0;
+    while ((nl = (char*)memchr(&block.chars[scan], '\n', block.len - scan)) != NULL)
+    {
+      if (push_line(ar, &mem, &block.chars[from], nl - &block.chars[from]) == MEM_ERROR)
+        goto fail;
+      from = scan = nl - block.chars + 1;
+    }
+
+    if (n == 0) break;
+
+    if (publish != NULL && publish(ar, bytes, arg))
+      goto fail;
+
+    memmove(block.chars, &block.chars[from], block.len - from);
+    block.len -= from;
+    scan = block.len;
+  }
+
+  if (push_line(ar, &mem, &block.chars[from], block.len - from) == MEM_ERROR)
+    goto fail;
+  free(block.chars);
+
+  tmp = (str*)realloc(ar->lines, ar->num * sizeof(str));
+  if (tmp != NULL) ar->lines = tmp;
+
+  return ar->num - start;
+
+fail:
+  free(block.chars);
+  return MEM_ERROR;
+}
+
+/* publish for read_lines that interns the lines added since it last ran,
+   so a repetitive file never takes its full size */
+int intern_read(struct arraystr *ar, long bytes, void *arg)
+{
+  int j = ar->num;
+
+  (void)bytes;
+  (void)arg;
+
+  while (j > 0 && !interned(ar->lines[j - 1].chars))
+    j--;
+  /* a line it fails on keeps storage of its own */
+  for (; j < ar->num; j++)
+    line_intern(&ar->lines[j]);
+
+  return 0;
+}
+
+/* read_lines interning as it goes under set intern yes; the lines are
+   then freed with release, never freear */
+ssize_t read_file(int fd, struct arraystr *ar)
+{
+  ssize_t n;
+
+  if (!E.intern) return read_lines(fd, ar, NULL, NULL);
+
+  n = read_lines(fd, ar, intern_read, NULL);
+  intern_read(ar, 0, NULL);
+  return n;
+}
+
+/* publish for read_lines that moves the lines read so far to the end of
+   text arg, keeping it in its memory budget while it grows */
+int text_fill(struct arraystr *ar, long bytes, void *arg)
+{
+  struct text *t = (struct text*)arg;
+  long size = 0;
+  int j;
+
+  if (E.intern) intern_read(ar, bytes, NULL);
+  if (text_splice(t, t->num, 0, ar->lines, ar->num) == MEM_ERROR) return MEM_ERROR;
+
+  for (j = 0; j < ar->num; j++)
+    size += ar->lines[j].length + 1 + sizeof(str);
+  atomic_fetch_add(&K.grown, size);
+
+  ar->num = 0;
+  squeeze_grown(t);
+  return 0;
+}
+
+void set_name(char *filename)
+{
+  free(E.filename);
+  E.filename = strdup(filename);
+}
+
+int e_read(char *filename)
+{
+  struct arraystr text = {NULL, 0};
+  struct text fresh = {NULL, 0, 0};
+  str empty = {"", 0};
+  off_t size = 0;
+  int res;
+  int fd;
+
+  save_wait();
+
+  if (E.index && index_open(filename, &fresh, &size) == 0)
+  {
+    text_release(&T);
+    T = fresh;
+    E.gen++;
+    follow_mark(size);
+    return 0;
+  }
+
+  fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+  {
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+  	 msg("failed to open file\n");
+  	 return -1;
+    }
+    res = split(&text, empty);
+  }
+  else
+    res = read_lines(fd, &text, text_fill, &fresh);
+
+  if (res >= 0) size = lseek(fd, 0, SEEK_CUR);
+  close(fd);
+
+  /* the last line, or the one empty line of a new file */
+  if (res < 0 || text_fill(&text, 0, &fresh) == MEM_ERROR)
+  {
+    release(&text);
+    text_release(&fresh);
+    return -1;
+  }
+  free(text.lines);
+
+  text_release(&T);
+  T = fresh;
+  E.gen++;
+  follow_mark(size);
+
+  return 0;
+}
+
+int e_open(char *filename)
+{
+  follow_stop();
+  if (!e_read(filename))
+    set_name(filename);
+  else return -1;
+
+  return 0;
+}
+
+/* moves the lines the loader has read so far to the end of T */
+int load_publish(struct arraystr *ar, long bytes, void *arg)
+{
+  str *tmp = NULL;
+  long size = 0;
+  int cancel;
+  int j;
+
+  (void)arg;
+
+  for (j = 0; j < ar->num; j++)
+    size += ar->lines[j].length + 1 + sizeof(str);
+
+  pthread_mutex_lock(&L.lock);
+
+  /* under a memory budget the lines wait in the file until T takes the
+     ones read before, where it can page them out */
+  while (L.budget > 0 && L.rbytes > L.budget / 2 && !L.cancel)
+    pthread_cond_wait(&L.cond, &L.lock);
+  if (L.ready.num + ar->num > L.mready)
+  {
+    tmp = (str*)realloc(L.ready.lines, (L.ready.num + ar->num) * 2 * sizeof(str));
+    if (tmp == NULL)
+    {
+      pthread_mutex_unlock(&L.lock);
+      return MEM_ERROR;
+    }
+    L.ready.lines = tmp;
+    L.mready = (L.ready.num + ar->num) * 2;
+  }
+  memcpy(&L.ready.lines[L.ready.num], ar->lines, ar->num * sizeof(str));
+  L.ready.num += ar->num;
+  L.rbytes += size;
+  L.bytes = bytes;
+  cancel = L.cancel;
+  pthread_cond_broadcast(&L.cond);
+  pthread_mutex_unlock(&L.lock);
+
+  ar->num = 0;
+  return cancel;
+}
+
+void *load_loop(void *arg)
+{
+  struct arraystr text = {NULL, 0};
+  int res;
+
+  res = read_lines(L.fd, &text, load_publish, NULL);
+  if (res >= 0)
+    res = load_publish(&text, lseek(L.fd, 0, SEEK_CUR), NULL) ? -1 : 0;
+
+  close(L.fd);
+  freear(&text);
+
+  pthread_mutex_lock(&L.lock);
+  L.result = res;
+  L.done = 1;
+  pthread_cond_broadcast(&L.cond);
+  pthread_mutex_unlock(&L.lock);
+
+  return arg;
+}
+
+/* e_open that returns at once and leaves the reading to a helper thread */
+int e_open_async(char *filename)
+{
+  struct stat st;
+  int fd;
+
+  /* through the index there is nothing to wait for */
+  if (E.index) return e_open(filename);
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0)
+  {
+    if (fd >= 0) close(fd);
+    return e_open(filename);
+  }
+
+  set_name(filename);
+  text_release(&T);
+  E.gen++;
+
+  L.fd = fd;
+  L.size = st.st_size;
+  L.bytes = 0;
+  L.budget = E.budget;
+  L.rbytes = 0;
+  L.done = 0;
+  L.cancel = 0;
+  L.active = 1;
+
+  if (spawn_helper(&L.thread, load_loop, NULL) != 0)
+  {
+    L.active = 0;
+    close(fd);
+    return e_open(filename);
+  }
+
+  return 0;
+}
+
+void load_take()
+{
+  int from = T.num;
+  int done;
+
+  if (!L.active) return;
+
+  pthread_mutex_lock(&L.lock);
+  if (text_splice(&T, T.num, 0, L.ready.lines, L.ready.num) == 0)
+  {
+    atomic_fetch_add(&K.grown, L.rbytes);
+    L.ready.num = 0;
+    L.rbytes = 0;
+    pthread_cond_broadcast(&L.cond);
+  }
+  done = L.done && L.ready.num == 0;
+  pthread_mutex_unlock(&L.lock);
+
+  if (E.intern) text_intern(&T, from, T.num);
+
+  squeeze_grown(&T);
+  if (!done) return;
+
+  pthread_join(L.thread, NULL);
+  L.active = 0;
+  freear(&L.ready);
+  L.mready = 0;
+  follow_mark(L.bytes);
+
+  if (L.result < 0)
+    msg("failed to read %s, only %d lines were loaded\n", E.filename, T.num);
+}
+
+/* waits until T has n lines or the whole file, showing progress on a tty */
+void load_until(int n)
+{
+  struct timespec ts;
+  long shown = -1;
+
+  load_take();
+
+  while (L.active && T.num < n)
+  {
+    pthread_mutex_lock(&L.lock);
+    if (!L.done && L.ready.num == 0)
+    {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 200000000;
+      if (ts.tv_nsec >= 1000000000)
+      {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&L.cond, &L.lock, &ts);
+    }
+    if (E.tty && !E.printing && L.size > 0 && L.bytes * 100 / L.size != shown)
+    {
+      shown = L.bytes * 100 / L.size;
+      printf("\rloading %s: %ld%%", E.filename, shown);
+      fflush(stdout);
+    }
+    pthread_mutex_unlock(&L.lock);
+
+    load_take();
+  }
+
+  if (shown >= 0) printf("\r\x1b[K");
+}
+
+/* stops the loader and drops what it read but T did not take */
+void load_cancel()
+{
+  if (!L.active) return;
+
+  pthread_mutex_lock(&L.lock);
+  L.cancel = 1;
+  pthread_cond_broadcast(&L.cond);
+  pthread_mutex_unlock(&L.lock);
+
+  pthread_join(L.thread, NULL);
+  L.active = 0;
+  freear(&L.ready);
+  L.mready = 0;
+}
+
+/* writes the lines of a snapshot to fd a BLOCK at a time */
+/* the save reads the snapshot a chunk at a time and brings no lines
+   into memory: a packed chunk is read into a copy (see chunk_copy) and
+   left as it is. The editing thread may unpack it or page it out
+   meanwhile, under K.lock, but packs nothing the snapshot holds */
+
+/* the bytes chunk k of s takes in the file, with a newline after every
+   line */
+long save_size(struct text *s, int k)
+{
+  struct chunk *c = s->tab->chunks[k];
+  long size = 0;
+  int packed;
+  int j;
+
+  pthread_mutex_lock(&K.lock);
+  packed = atomic_load(&c->packed);
+  if (packed && c->blob == NULL && c->off < 0)
+    /* the last chunk of its file has no newline after its last line */
+    size = c->rawlen + (k == s->tab->n - 1);
+  else if (packed)
+    size = c->rawlen - c->count * sizeof(int) + c->count;
+  pthread_mutex_unlock(&K.lock);
+  if (packed) return size;
+
+  for (j = 0; j < c->count; j++)
+    size += c->lines[j].length + 1;
+  return size;
+}
+
+/* appends the lines of chunk k of s to buf as they go in the file */
+int save_chunk(struct text *s, int k, buffer *buf)
+{
+  struct chunk *c = s->tab->chunks[k];
+  char *raw = NULL;
+  char *p;
+  char *nl;
+  int file;
+  int got;
+  int pos;
+  int len;
+  int res = 0;
+  int j;
+
+  pthread_mutex_lock(&K.lock);
+  if (!atomic_load(&c->packed))
+  {
+    pthread_mutex_unlock(&K.lock);
+    for (j = 0; j < c->count && res == 0; j++)
+    {
+      res = append(buf, c->lines[j].chars, c->lines[j].length);
+      if (res == 0 && (k < s->tab->n - 1 || j < c->count - 1)) res = append(buf, "\n", 1);
+    }
+    return res;
+  }
+
+  file = c->blob == NULL && c->off < 0;
+  got = chunk_copy(c, &raw);
+  pthread_mutex_unlock(&K.lock);
+  if (got < 0) return -1;
+
+  /* split the way chunk_unpack and source_read do */
+  p = raw;
+  pos = c->count * sizeof(int);
+  for (j = 0; j < c->count && res == 0; j++)
+  {
+    if (file)
+    {
+      nl = (char*)memchr(p, '\n', raw + got - p);
+      len = nl != NULL ? nl - p : raw + got - p;
+      res = append(buf, p, len);
+      p = nl != NULL ? nl + 1 : raw + got;
+    }
+    else
+    {
+      memcpy(&len, raw + j * sizeof(int), sizeof(int));
+      res = append(buf, raw + pos, len);
+      pos += len;
+    }
+    if (res == 0 && (k < s->tab->n - 1 || j < c->count - 1)) res = append(buf, "\n", 1);
+  }
+
+  free(raw);
+  return res;
+}
+
+void *save_loop(void *arg)
+{
+  buffer buf = NEWBUF;
+  long total = 0;
+  int res = 0;
+  int k;
+
+  for (k = 0; W.snap.tab != NULL && k < W.snap.tab->n; k++)
+    total += save_size(&W.snap, k);
+  if (total > 0) total--;
+
+  pthread_mutex_lock(&W.lock);
+  W.total = total;
+  pthread_mutex_unlock(&W.lock);
+
+  for (k = 0; W.snap.tab != NULL && k < W.snap.tab->n && res == 0; k++)
+  {
+    res = save_chunk(&W.snap, k, &buf);
+
+    if (res == 0 && (buf.len >= BLOCK || k == W.snap.tab->n - 1))
+    {
+      if (write(W.fd, buf.chars, buf.len) != buf.len) res = -1;
+
+      pthread_mutex_lock(&W.lock);
+      W.written += buf.len;
+      pthread_mutex_unlock(&W.lock);
+      buf.len = 0;
+    }
+  }
+
+  if (close(W.fd) != 0) res = -1;
+  free(buf.chars);
+
+  /* written next to the file, which lives on under chunks still read
+     from it once this takes its name */
+  if (W.tmpname != NULL && (res != 0 || rename(W.tmpname, W.target) != 0))
+  {
+    unlink(W.tmpname);
+    res = -1;
+  }
+
+  pthread_mutex_lock(&W.lock);
+  W.result = res;
+  W.done = 1;
+  pthread_mutex_unlock(&W.lock);
+
+  return arg;
+}
+
+/* takes a snapshot of the text and writes it on a helper thread, E.saved
+   is set once that snapshot is on disk and the text is unchanged */
+int e_write(char *filename)
+{
+  struct stat st;
+  char *tmpname = NULL;
+  mode_t mask;
+  int fd;
+
+  if (filename == NULL)
+  {
+    if (E.filename == NULL)
+    {
+      msg("file name is not associated\n");
+      return 1;
+    }
+    else
+      filename = E.filename;
+  }
+  else if (E.filename == NULL)
+    set_name(filename);
+
+  if (W.pending) save_wait();
+
+  /* the file is written under a temporary name and replaced once it is
+     all there: readers never see half of it, and chunks still read from
+     the old one (see INDEX) keep it. A link is followed to its target */
+  W.target = realpath(filename, NULL);
+  if (W.target == NULL)
+    W.target = strdup(filename);
+  W.filename = strdup(filename);
+  tmpname = W.target == NULL ? NULL : (char*)malloc(strlen(W.target) + 8);
+  if (tmpname == NULL || W.filename == NULL)
+  {
+    msg("failed to open file\n");
+    goto fail;
+  }
+  sprintf(tmpname, "%s.XXXXXX", W.target);
+  fd = mkstemp(tmpname);
+  if (fd < 0)
+  {
+    msg("failed to open file\n");
+    goto fail;
+  }
+  if (stat(W.target, &st) == 0)
+    fchmod(fd, st.st_mode & 07777);
+  else
+  {
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  if (snapshot(&T, &W.snap) == MEM_ERROR)
+  {
+    close(fd);
+    unlink(tmpname);
+    goto fail;
+  }
+  W.tmpname = tmpname;
+
+  W.fd = fd;
+  W.gen = E.gen;
+  W.done = 0;
+  W.result = 0;
+  W.written = 0;
+  W.total = 0;
+  W.pending = 1;
+
+  W.threaded = spawn_helper(&W.thread, save_loop, NULL) == 0;
+  if (!W.threaded)
+    save_loop(NULL);
+
+  return 0;
+
+fail:
+  free(tmpname);
+  free(W.target);
+  W.target = NULL;
+  free(W.filename);
+  W.filename = NULL;
+  return 1;
+}
+
+/* finishes a save whose thread is done, returns 1 if one was collected */
+int save_collect()
+{
+  int done;
+
+  if (!W.pending) return 0;
+
+  pthread_mutex_lock(&W.lock);
+  done = W.done;
+  pthread_mutex_unlock(&W.lock);
+  if (!done) return 0;
+
+  if (W.threaded)
+    pthread_join(W.thread, NULL);
+  W.threaded = 0;
+
+  if (W.result != 0)
+    msg("failed to write %s\n", W.filename);
+  else if (W.gen == E.gen)
+    E.saved = 1;
+
+  W.pending = 0;
+  snapshot_drop(&W.snap);
+  free(W.filename);
+  W.filename = NULL;
+  free(W.target);
+  W.target = NULL;
+  free(W.tmpname);
+  W.tmpname = NULL;
+
+  return 1;
+}
+
+void save_wait()
+{
+  if (!W.pending) return;
+
+  if (W.threaded)
+    pthread_join(W.thread, NULL);
+  W.threaded = 0;
+  save_collect();
+}
+
+void save_status()
+{
+  long written;
+  long total;
+
+  save_collect();
+
+  if (!W.pending)
+  {
+    fprintf(output(), "no save in progress, text is %s\n", E.saved ? "saved" : "not saved");
+    return;
+  }
+
+  pthread_mutex_lock(&W.lock);
+  written = W.written;
+  total = W.total;
+  pthread_mutex_unlock(&W.lock);
+
+  fprintf(output(), "saving %s: %ld of %ld bytes\n", W.filename, written, total);
+}
+
+/* INDEX
+  _______
+*/
+
+/* with set index yes a file is opened through F.idx next to it, which
+   holds where every CHUNK-th line of F starts, with the size, mtime and
+   a sum of the bytes those offsets cover. The text is then made of
+   chunks that read their lines from F the first time they are needed,
+   so opening takes about no time whatever the size. A file that only
+   grew since, as logs do, is scanned from its last chunk on and the
+   index written again. The sum is over the first and the last BLOCK of
+   what was indexed, enough to tell a grown log from a file written anew */
+
+#define INDEX_MAGIC "edidx01"
+
+struct index_head
+{
+  char magic[8];
+  int64_t size;
+  int64_t mtime;
+  uint64_t sum;
+  int64_t lines;
+  int64_t marks;
+};
+
+/* where lines 0, CHUNK, 2 * CHUNK... start, and the number of the line
+   the scan is in */
+struct marks
+{
+  int64_t *at;
+  long num;
+  long mem;
+  int64_t line;
+};
+
+int mark_push(struct marks *m, int64_t at)
+{
+  int64_t *tmp = NULL;
+
+  if (m->num == m->mem)
+  {
+    m->mem = m->mem < BUFFADD ? BUFFADD : m->mem * 2;
+    tmp = (int64_t*)realloc(m->at, m->mem * sizeof(int64_t));
+    if (tmp == NULL) return MEM_ERROR;
+    m->at = tmp;
+  }
+  m->at[m->num++] = at;
+  return 0;
+}
+
+/* FNV-1a over the first and the last BLOCK of the first size bytes of fd */
+int index_sum(int fd, off_t size, uint64_t *sum)
+{
+  unsigned char *buf = (unsigned char*)malloc(BLOCK);
+  off_t from[2] = {0, size > BLOCK ? size - BLOCK : 0};
+  ssize_t want;
+  ssize_t n;
+  int part;
+  int j;
+
+  if (buf == NULL) return MEM_ERROR;
+
+  *sum = 14695981039346656037ULL;
+  for (part = 0; part < 2; part++)
+  {
+    want = size - from[part] < BLOCK ? size - from[part] : BLOCK;
+    n = pread(fd, buf, want, from[part]);
+    if (n != want)
+    {
+      free(buf);
+      return -1;
+    }
+    for (j = 0; j < n; j++)
+      *sum = (*sum ^ buf[j]) * 1099511628211ULL;
+  }
+
+  free(buf);
+  return 0;
+}
+
+/* finds the lines of fd from byte from to byte size, from being the
+   start of line m->line, and marks the ones a chunk starts at */
+int index_scan(int fd, off_t from, off_t size, struct marks *m)
+{
+  char *buf = (char*)malloc(BLOCK);
+  char *p;
+  char *nl;
+  ssize_t n;
+
+  if (buf == NULL) return MEM_ERROR;
+
+  while (from < size)
+  {
+    n = pread(fd, buf, size - from < BLOCK ? size - from : BLOCK, from);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+    {
+      free(buf);
+      return -1;
+    }
+
+    for (p = buf; (nl = (char*)memchr(p, '\n', buf + n - p)) != NULL; p = nl + 1)
+      if (++m->line % CHUNK == 0 && mark_push(m, from + (nl - buf) + 1) == MEM_ERROR)
+      {
+        free(buf);
+        return MEM_ERROR;
+      }
+    from += n;
+  }
+
+  free(buf);
+  return 0;
+}
+
+/* writes the index of the first st->st_size bytes of fd as filename.idx,
+   by way of a temp file so no one maps half of it */
+int index_write(char *filename, int fd, struct stat *st, struct marks *m)
+{
+  struct index_head h;
+  char *path = (char*)malloc(strlen(filename) + 12);
+  int out;
+  int res = -1;
+
+  if (path == NULL) return MEM_ERROR;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+  h.size = st->st_size;
+  h.mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+  h.lines = m->line + 1;
+  h.marks = m->num;
+
+  sprintf(path, "%s.idx.XXXXXX", filename);
+  if (index_sum(fd, st->st_size, &h.sum) != 0 || (out = mkstemp(path)) < 0)
+  {
+    free(path);
+    return -1;
+  }
+
+  fchmod(out, st->st_mode & 0666);
+  if (write(out, &h, sizeof(h)) == sizeof(h)
+      && write(out, m->at, m->num * sizeof(int64_t)) == (ssize_t)(m->num * sizeof(int64_t)))
+    res = 0;
+  if (close(out) != 0) res = -1;
+
+  if (res == 0)
+  {
+    /* filename.idx.XXXXXX without its last 7 */
+    char *tmp = strdup(path);
+
+    if (tmp == NULL) res = -1;
+    else
+    {
+      tmp[strlen(tmp) - 7] = '\0';
+      res = rename(path, tmp);
+      free(tmp);
+    }
+  }
+  if (res != 0) unlink(path);
+
+  free(path);
+  return res;
+}
+
+/* maps filename.idx, NULL if there is none or it is not one */
+struct index_head *index_map(char *filename, size_t *len)
+{
+  struct index_head *h;
+  struct stat st;
+  char *path = (char*)malloc(strlen(filename) + 5);
+  int fd;
+
+  if (path == NULL) return NULL;
+  sprintf(path, "%s.idx", filename);
+  fd = open(path, O_RDONLY);
+  free(path);
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct index_head))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  h = (struct index_head*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (h == MAP_FAILED) return NULL;
+
+  *len = st.st_size;
+  if (memcmp(h->magic, INDEX_MAGIC, sizeof(h->magic)) || h->marks < 1 || h->lines < 1
+      || h->marks != (h->lines + CHUNK - 1) / CHUNK
+      || (size_t)h->marks != (*len - sizeof(struct index_head)) / sizeof(int64_t))
+  {
+    munmap(h, *len);
+    return NULL;
+  }
+  return h;
+}
+
+/* a text of lines lines whose chunk k starts at byte at[k] of the file
+   fd, size bytes long; the chunks read their lines when first needed */
+int index_text(int fd, struct stat *st, int64_t *at, int64_t lines, struct text *out)
+{
+  struct source *src = NULL;
+  struct table *tab = NULL;
+  struct chunk *c;
+  long n = (lines + CHUNK - 1) / CHUNK;
+  int64_t end;
+  long k;
+
+  if (lines > INT_MAX) return -1;
+  for (k = 0; k < n; k++)
+  {
+    end = k + 1 < n ? at[k + 1] : st->st_size;
+    if (end < at[k] || end - at[k] >= INT_MAX) return -1;
+  }
+
+  src = (struct source*)malloc(sizeof(struct source));
+  tab = table_new(n);
+  if (src == NULL || tab == NULL)
+  {
+    free(src);
+    table_drop(tab);
+    return MEM_ERROR;
+  }
+
+  for (k = 0; k < n; k++)
+  {
+    c = (struct chunk*)malloc(sizeof(struct chunk));
+    if (c == NULL)
+    {
+      while (k-- > 0) free(tab->chunks[k]);
+      free(tab->chunks);
+      free(tab->start);
+      free(tab);
+      free(src);
+      return MEM_ERROR;
+    }
+
+    atomic_init(&c->refs, 1);
+    atomic_init(&c->packed, 1);
+    atomic_init(&c->used, atomic_load(&K.tick));
+    c->bytes = -1;
+    c->dense = 0;
+    c->count = k + 1 < n ? CHUNK : lines - k * CHUNK;
+    c->rawlen = (k + 1 < n ? at[k + 1] : st->st_size) - at[k];
+    c->size = 0;
+    c->blob = NULL;
+    c->off = -1;
+    c->src = src;
+    c->at = at[k];
+    c->summed = 0;
+    c->lines = NULL;
+    tab->chunks[k] = c;
+    tab->start[k + 1] = k * CHUNK + c->count;
+  }
+  tab->n = n;
+
+  src->refs = n;
+  src->fd = fd;
+  src->lost = 0;
+  src->dev = st->st_dev;
+  src->ino = st->st_ino;
+
+  pthread_mutex_lock(&K.lock);
+  src->next = X.list;
+  X.list = src;
+  pthread_mutex_unlock(&K.lock);
+
+  out->tab = tab;
+  out->num = lines;
+  out->epoch = 0;
+  return 0;
+}
+
+/* opens filename through its index, making or updating the index as
+   needed; -1 leaves it to e_read to read the file as usual */
+int index_open(char *filename, struct text *out, off_t *size)
+{
+  struct index_head *h = NULL;
+  struct marks m = {NULL, 0, 0, 0};
+  struct stat st;
+  uint64_t sum;
+  size_t len = 0;
+  int64_t mtime;
+  int fd = open(filename, O_RDONLY);
+  int res = -1;
+
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return -1;
+  }
+  mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+  h = index_map(filename, &len);
+  if (h != NULL && (h->size > st.st_size || index_sum(fd, h->size, &sum) != 0 || sum != h->sum))
+  {
+    munmap(h, len);
+    h = NULL;
+  }
+
+  /* as it was indexed */
+  if (h != NULL && h->size == st.st_size && h->mtime == mtime)
+    res = index_text(fd, &st, (int64_t*)(h + 1), h->lines, out);
+  else
+  {
+    /* grown since, or never indexed: the marks it has stand, the
+       last chunk is scanned again from its start */
+    if (h == NULL || h->size == st.st_size)
+      res = mark_push(&m, 0);
+    else
+    {
+      m.mem = m.num = h->marks;
+      m.at = (int64_t*)malloc(m.mem * sizeof(int64_t));
+      res = m.at == NULL ? MEM_ERROR : 0;
+      if (res == 0)
+      {
+        memcpy(m.at, h + 1, m.num * sizeof(int64_t));
+        m.line = (m.num - 1) * CHUNK;
+      }
+    }
+
+    if (res == 0)
+      res = index_scan(fd, m.at[m.num - 1], st.st_size, &m);
+    if (res == 0)
+    {
+      /* no index where it cannot be written, the file opens all the same */
+      index_write(filename, fd, &st, &m);
+      res = index_text(fd, &st, m.at, m.line + 1, out);
+    }
+  }
+
+  if (h != NULL) munmap(h, len);
+  free(m.at);
+  if (res != 0) close(fd);
+  else *size = st.st_size;
+  return res;
+}
+
+/* reads the lines of chunk c from the file it came from, under K.lock.
+   What the file lost since comes back as empty lines */
+int source_read(struct chunk *c)
+{
+  char *raw = (char*)malloc(c->rawlen > 0 ? c->rawlen : 1);
+  char *p;
+  char *nl;
+  ssize_t n;
+  int got = 0;
+  int len;
+  int j;
+
+  c->lines = (str*)malloc(CHUNK * sizeof(str));
+  if (raw == NULL || c->lines == NULL) goto fail;
+
+  while (got < c->rawlen)
+  {
+    n = pread(c->src->fd, raw + got, c->rawlen - got, c->at + got);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    got += n;
+  }
+  if (got < c->rawlen && !c->src->lost)
+  {
+    c->src->lost = 1;
+    fprintf(stderr, "the file changed on disk, lines it lost are left empty\n");
+  }
+  atomic_fetch_add(&K.grown, c->rawlen + CHUNK * sizeof(str));
+
+  p = raw;
+  for (j = 0; j < c->count; j++)
+  {
+    nl = (char*)memchr(p, '\n', raw + got - p);
+    len = nl != NULL ? nl - p : raw + got - p;
+
+    c->lines[j].chars = (char*)malloc(len + 1);
+    if (c->lines[j].chars == NULL) goto fail;
+    memcpy(c->lines[j].chars, p, len);
+    c->lines[j].chars[len] = '\0';
+    c->lines[j].length = len;
+    p = nl != NULL ? nl + 1 : raw + got;
+
+    if (E.intern) line_intern(&c->lines[j]);
+  }
+
+  free(raw);
+  return 0;
+
+fail:
+  free(raw);
+  return MEM_ERROR;
+}
+
+/* lets go of a chunk's hold on src, closing it after the last one */
+void source_drop(struct source *src)
+{
+  struct source **p;
+
+  pthread_mutex_lock(&K.lock);
+  if (--src->refs > 0)
+  {
+    pthread_mutex_unlock(&K.lock);
+    return;
+  }
+  for (p = &X.list; *p != src; p = &(*p)->next)
+    ;
+  *p = src->next;
+  pthread_mutex_unlock(&K.lock);
+
+  close(src->fd);
+  free(src);
+}
+
+/* 1 if chunks still read from filename, which a write then must not
+   truncate under them */
+int source_busy(char *filename)
+{
+  struct source *src;
+  struct stat st;
+  int busy = 0;
+
+  if (stat(filename, &st) < 0) return 0;
+
+  pthread_mutex_lock(&K.lock);
+  for (src = X.list; src != NULL && !busy; src = src->next)
+    busy = src->dev == st.st_dev && src->ino == st.st_ino;
+  pthread_mutex_unlock(&K.lock);
+
+  return busy;
+}
+
+/* FOLLOW
+  ________
+*/
+
+/* follow watches the file with inotify, and the directory it is in for
+   a new file taking its name. What is appended is read from where the
+   text ends: its first line goes on the last line of the text, the rest
+   are added after it, just as a read of the whole file would have split
+   them. If that last line was edited since the file was read, it is not
+   the file's any more and what comes starts a line of its own. A file
+   that got shorter or was replaced, as logs are rotated, is read again
+   if the text was saved, otherwise following stops */
+
+void follow_stop()
+{
+  if (!O.active) return;
+
+  close(O.watch);
+  close(O.fd);
+  O.active = 0;
+}
+
+/* notes that the text ends where the file does at size */
+void follow_mark(off_t size)
+{
+  str *last = T.num > 0 ? line_at(&T, T.num - 1) : NULL;
+
+  O.size = size;
+  O.tail = last != NULL ? line_hash(*last) : 0;
+}
+
+/* opens E.filename and watches it, the read goes on from O.size */
+int follow_arm()
+{
+  char *dir = NULL;
+  char *slash;
+
+  O.fd = open(E.filename, O_RDONLY);
+  if (O.fd < 0) return -1;
+
+  dir = strdup(E.filename);
+  if (dir == NULL)
+  {
+    close(O.fd);
+    return MEM_ERROR;
+  }
+  slash = strrchr(dir, '/');
+  if (slash == NULL) strcpy(dir, ".");
+  else if (slash == dir) slash[1] = '\0';
+  else *slash = '\0';
+
+  O.watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (O.watch < 0
+      || (O.wfile = inotify_add_watch(O.watch, E.filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)) < 0
+      || inotify_add_watch(O.watch, dir, IN_CREATE | IN_MOVED_TO) < 0)
+  {
+    if (O.watch >= 0) close(O.watch);
+    close(O.fd);
+    free(dir);
+    return -1;
+  }
+
+  free(dir);
+  O.active = 1;
+  return 0;
+}
+
+int follow_start()
+{
+  if (E.filename == NULL)
+  {
+    msg("file name is not associated\n");
+    return -1;
+  }
+  if (O.active) return 0;
+
+  if (follow_arm() != 0)
+  {
+    msg("failed to follow %s\n", E.filename);
+    return -1;
+  }
+
+  /* what was added since it was read */
+  return follow_take(1) < 0 ? -1 : 0;
+}
+
+/* reads what was appended to the file since O.size into the text,
+   returns the number of lines it grew by */
+int follow_append()
+{
+  struct arraystr text = {NULL, 0};
+  str *last;
+  char *tmp;
+  off_t end;
+  int from = T.num;
+
+  if (lseek(O.fd, O.size, SEEK_SET) < 0 || read_file(O.fd, &text) < 0) goto fail;
+  end = lseek(O.fd, 0, SEEK_CUR);
+  if (end == O.size)
+  {
+    release(&text);
+    return 0;
+  }
+
+  /* the rest of the line the text ends with, if that is still the one
+     read from the file */
+  last = T.num > 0 ? line_at(&T, T.num - 1) : NULL;
+  if (last != NULL && text.num > 0 && line_hash(*last) == O.tail)
+  {
+    if (text.lines[0].length > 0)
+    {
+      last = line_mut(&T, T.num - 1);
+      if (last == NULL) goto fail;
+      tmp = (char*)malloc(last->length + text.lines[0].length + 1);
+      if (tmp == NULL) goto fail;
+
+      memcpy(tmp, last->chars, last->length);
+      memcpy(tmp + last->length, text.lines[0].chars, text.lines[0].length + 1);
+      line_free(last->chars);
+      last->chars = tmp;
+      last->length += text.lines[0].length;
+    }
+    line_free(text.lines[0].chars);
+    memmove(text.lines, &text.lines[1], --text.num * sizeof(str));
+  }
+
+  if (text_splice(&T, T.num, 0, text.lines, text.num) == MEM_ERROR) goto fail;
+  free(text.lines);
+
+  /* the file itself grew, so a saved text stays saved */
+  E.gen++;
+  follow_mark(end);
+  return T.num - from;
+
+fail:
+  release(&text);
+  msg("failed to read what was added to %s\n", E.filename);
+  return -1;
+}
+
+/* brings the text up to the file when inotify saw it change, or always
+   with force; returns the lines added, or -1 when following stopped.
+   An open batch counts lines from begin, so what the file gains waits
+   in the watch until commit or rollback */
+int follow_take(int force)
+{
+  char events[4096];
+  struct stat now;
+  struct stat st;
+  int moved;
+  int n;
+
+  if (!O.active || B.active) return 0;
+
+  while ((n = read(O.watch, events, sizeof(events))) > 0)
+    force = 1;
+  if (!force) return 0;
+
+  /* appended before it went away, or before it was truncated */
+  if (fstat(O.fd, &st) < 0) return -1;
+  n = st.st_size >= O.size ? follow_append() : 0;
+  if (n < 0)
+  {
+    follow_stop();
+    return -1;
+  }
+
+  /* moved away and nothing in its place yet: wait for the new one */
+  if (stat(E.filename, &now) < 0) return n;
+  moved = now.st_dev != st.st_dev || now.st_ino != st.st_ino;
+  if (!moved && st.st_size >= O.size) return n;
+
+  follow_stop();
+  if (!E.saved)
+  {
+    msg("%s was %s, the text is not saved: follow stopped\n", E.filename, moved ? "replaced" : "truncated");
+    return -1;
+  }
+  if (e_read(E.filename) != 0 || follow_arm() != 0)
+  {
+    msg("failed to read %s again: follow stopped\n", E.filename);
+    return -1;
+  }
+  O.reread++;
+  return T.num;
+}
+
+
+
+/* SETTINGS 
+  _________
+*/
+void set_wrap(int k)
+{
+  E.wrap = k;
+}
+
+void set_numbers(int k)
+{
+  E.numbers = k;
+}
+
+void set_tabwidth(int k)
+{
+  E.tabwidth = k;
+}
+
+
+/* EDITOR OPERATIONS
+  __________________
+*/
+
+/* every change to the text goes through here, undo uses gen to tell
+   whether its record still describes the text */
+void modified()
+{
+  E.saved = 0;
+  E.gen++;
+}
+
+/* frees line storage, or retires it while a snapshot may still read it */
+void line_free(char *chars)
+{
+  struct retired *tmp = NULL;
+
+  if (atom_release(chars)) return;
+
+  pthread_mutex_lock(&Z.lock);
+  if (Z.nlive == 0)
+  {
+    pthread_mutex_unlock(&Z.lock);
+    free(chars);
+    return;
+  }
+
+  if (Z.nlist == Z.mlist)
+  {
+    tmp = (struct retired*)realloc(Z.list, (Z.mlist + BUFFADD) * sizeof(struct retired));
+    if (tmp == NULL)
+    {
+      /* leaked rather than pulled from under a reader */
+      pthread_mutex_unlock(&Z.lock);
+      return;
+    }
+    Z.list = tmp;
+    Z.mlist += BUFFADD;
+  }
+
+  Z.list[Z.nlist].chars = chars;
+  Z.list[Z.nlist++].stamp = Z.now;
+  pthread_mutex_unlock(&Z.lock);
+}
+
+/* gives line storage of its own before it is changed in place, a
+   snapshot or other interned lines may be reading the current one */
+int line_own(str *line)
+{
+  char *tmp = NULL;
+  int live;
+
+  pthread_mutex_lock(&Z.lock);
+  live = Z.nlive;
+  pthread_mutex_unlock(&Z.lock);
+  if (!live && !interned(line->chars)) return 0;
+
+  tmp = (char*)malloc(line->length + 1);
+  if (tmp == NULL) return MEM_ERROR;
+  memcpy(tmp, line->chars, line->length + 1);
+
+  line_free(line->chars);
+  line->chars = tmp;
+  return 0;
+}
+
+/* freear through line_free */
+void release(struct arraystr *ar)
+{
+  int j;
+
+  for (j = 0; j < ar->num; j++)
+    line_free(ar->lines[j].chars);
+  free(ar->lines);
+
+  ar->lines = NULL;
+  ar->num = 0;
+}
+
+int idxsubstr(str line, str tofind)
+{
+  int i;
+  int j;
+  int found;
+
+  if (tofind.length < 1)
+  {
+    msg("invalid parameter\n");
+    return -1;
+  }
+
+  for (i = 0; i <= line.length - tofind.length; i++)
+  {
+    if (line.chars[i] == tofind.chars[0])
+    {
+      found = 1;
+      for (j = 1; j < tofind.length; j++)
+      {
+        if (tofind.chars[j] != line.chars[i + j])
+        {
+          found = 0;
+          break;
+        }
+      }
+      if (found)
+        return i;
+    }
+  }
+
+  return -1;
+}
+
+int e_insert_after(str toin, int pos, struct text *t)
+{
+  struct arraystr text = {NULL, 0};
+  int added;
+
+  if (pos > t->num || pos < 0) 
+    {
+      msg("out of bounds\n");
+      return -1;
+    }
+
+  added = split(&text, toin);
+  if (added == MEM_ERROR || text_insert(t, pos, &text) == MEM_ERROR)
+  {
+    freear(&text);
+    return MEM_ERROR;
+  }
+
+  modified();
+  return added;
+}
+
+/* streams file F into the text after line pos; a final newline in F
+   does not add an empty line */
+int e_insert_file(char *filename, int pos)
+{
+  struct arraystr text = {NULL, 0};
+  int bound = B.active ? B.base : T.num;
+  int fd;
+
+  if (pos < 0 || pos > bound)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  save_wait();
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    msg("failed to open file\n");
+    return -1;
+  }
+
+  if (read_file(fd, &text) < 0)
+  {
+    close(fd);
+    release(&text);
+    return -1;
+  }
+  close(fd);
+
+  if (text.lines[text.num - 1].length == 0)
+    line_free(text.lines[--text.num].chars);
+
+  return insert_lines(&text, pos);
+}
+
+/* puts a copy of the lines of buffer n into the text after line pos */
+int e_insert_buffer(int n, int pos)
+{
+  struct arraystr text = {NULL, 0};
+  struct document *cur = D;
+  struct text *src;
+  int bound = B.active ? B.base : T.num;
+  int j;
+
+  if (n < 1 || n > F.num)
+  {
+    msg("no such buffer\n");
+    return -1;
+  }
+
+  if (pos < 0 || pos > bound)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  /* all of it, not just what its load has brought in so far */
+  D = F.docs[n - 1];
+  load_until(INT_MAX);
+  D = cur;
+
+  src = &F.docs[n - 1]->text;
+  text.lines = (str*)malloc((src->num ? src->num : 1) * sizeof(str));
+  if (text.lines == NULL) return MEM_ERROR;
+
+  for (; text.num < src->num; text.num++)
+  {
+    j = text.num;
+    text.lines[j].length = line_at(src, j)->length;
+    text.lines[j].chars = (char*)malloc(text.lines[j].length + 1);
+    if (text.lines[j].chars == NULL)
+    {
+      freear(&text);
+      return MEM_ERROR;
+    }
+    memcpy(text.lines[j].chars, line_at(src, j)->chars, text.lines[j].length + 1);
+  }
+
+  return insert_lines(&text, pos);
+}
+
+/* moves text into the text after line pos, or queues it in a batch */
+int insert_lines(struct arraystr *text, int pos)
+{
+  if (text->num == 0)
+  {
+    release(text);
+    return 0;
+  }
+
+  if (B.active)
+    return batch_queue(pos, text);
+
+  if (text_insert(&T, pos, text) == MEM_ERROR)
+  {
+    release(text);
+    return MEM_ERROR;
+  }
+
+  modified();
+  return 0;
+}
+
+int e_replace_substr(int start, int end, str tofind, str toreplace)
+{
+  int j;
+  int i;
+  int idx;
+  int index;
+  int added;
+  char *tmp = NULL;
+  str *line;
+  str toin;
+
+
+  if (start < 1 || start > T.num || end < 1 || end > T.num)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  for (j = start - 1; j < end;)
+  {
+    if (tofind.length <= 1 && tofind.chars[0] == '^')
+    {
+      index = 0;
+      tofind.length = 0;
+    }
+    else if (tofind.length <= 1 && tofind.chars[0] == '$')
+    {
+      index = line_at(&T, j)->length;
+      tofind.length = 0;
+    }
+    else
+      index = idxsubstr(*line_at(&T, j), tofind);
+
+    if (index != -1)
+    {
+      idx = 0;
+      line = line_at(&T, j);
+      tmp = (char*)malloc(line->length - tofind.length + toreplace.length + 1);
+      if (tmp == NULL) return MEM_ERROR;
+
+      for (i = 0; i < index; i++)
+      {
+        tmp[idx++] = line->chars[i];
+      }
+      for (i = 0; i < toreplace.length; i++)
+      {
+        tmp[idx++] = toreplace.chars[i];
+      }
+      for (i = index + tofind.length; i < line->length; i++)
+      {
+        tmp[idx++] = line->chars[i];
+      }
+      tmp[idx] = '\0';
+
+      toin.chars = tmp;
+      toin.length = line->length - tofind.length + toreplace.length;
+
+      if (memchr(toreplace.chars, '\n', toreplace.length) == NULL)
+      {
+        /* still one line, swap it in place */
+        line = line_mut(&T, j);
+        if (line == NULL)
+        {
+          free(toin.chars);
+          return MEM_ERROR;
+        }
+        line_free(line->chars);
+        *line = toin;
+        modified();
+        j++;
+        continue;
+      }
+
+      e_delr(j+1, j+1);
+      added = e_insert_after(toin, j, &T);
+
+      free(toin.chars);
+      j += added;
+      end += (added - 1);
+    }
+    else j++;
+  }
+
+  return 0;
+}
+
+/* puts the line in the gap buffer back into the text */
+int gap_close()
+{
+  str *line;
+  char *tmp;
+  int len;
+
+  if (G.chars == NULL) return 0;
+
+  line = line_mut(&T, G.line);
+  if (line == NULL) return MEM_ERROR;
+
+  len = G.mem - (G.end - G.start);
+  memmove(&G.chars[G.start], &G.chars[G.end], G.mem - G.end);
+  G.chars[len] = '\0';
+  tmp = (char*)realloc(G.chars, len + 1);
+  if (tmp != NULL) G.chars = tmp;
+
+  line_free(line->chars);
+  line->chars = G.chars;
+  line->length = len;
+  G.chars = NULL;
+  return 0;
+}
+
+/* the length of line j, which may be in the gap buffer */
+int gap_length(int j)
+{
+  if (G.chars != NULL && G.line == j)
+    return G.mem - (G.end - G.start);
+  return line_at(&T, j)->length;
+}
+
+/* opens line j in the gap buffer, closing the one that was there, and
+   moves the hole to pos with room for at least need bytes. Moving it is
+   as dear as the distance, so edits near each other cost little */
+int gap_at(int j, int pos, int need)
+{
+  str *line;
+  char *tmp;
+  int mem;
+  int n;
+
+  if (G.chars != NULL && G.line != j && gap_close() == MEM_ERROR) return MEM_ERROR;
+
+  if (G.chars == NULL)
+  {
+    line = line_at(&T, j);
+    if (line == NULL) return MEM_ERROR;
+    mem = line->length + need + GAP;
+    G.chars = (char*)malloc(mem + 1);
+    if (G.chars == NULL) return MEM_ERROR;
+    memcpy(G.chars, line->chars, line->length);
+    G.line = j;
+    G.start = line->length;
+    G.end = mem;
+    G.mem = mem;
+  }
+
+  if (G.end - G.start < need)
+  {
+    mem = G.mem + need + G.mem / 2;
+    tmp = (char*)realloc(G.chars, mem + 1);
+    if (tmp == NULL) return MEM_ERROR;
+    n = G.mem - G.end;
+    memmove(&tmp[mem - n], &tmp[G.end], n);
+    G.chars = tmp;
+    G.end = mem - n;
+    G.mem = mem;
+  }
+
+  if (pos < G.start)
+  {
+    n = G.start - pos;
+    memmove(&G.chars[G.end - n], &G.chars[pos], n);
+    G.start -= n;
+    G.end -= n;
+  }
+  else if (pos > G.start)
+  {
+    n = pos - G.start;
+    memmove(&G.chars[G.start], &G.chars[G.end], n);
+    G.start += n;
+    G.end += n;
+  }
+  return 0;
+}
+
+/* puts n bytes into line j before its byte pos (0-based) */
+int gap_insert(int j, int pos, char *s, int n)
+{
+  if (gap_at(j, pos, n) == MEM_ERROR) return MEM_ERROR;
+  memcpy(&G.chars[G.start], s, n);
+  G.start += n;
+  modified();
+  return 0;
+}
+
+int e_insert_symbol(int j, char c, int pos)
+{
+  int len = gap_length(j);
+
+  if (pos > len) pos = len;
+  if (pos < 1) pos = 1;
+
+  return gap_insert(j, len > 0 ? pos - 1 : 0, &c, 1);
+}
+
+int e_insert_string(int j, str s, int pos)
+{
+  if (pos < 1 || pos > gap_length(j) + 1)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+  if (s.length == 0) return 0;
+
+  return gap_insert(j, pos - 1, s.chars, s.length);
+}
+
+int e_edit(int j, char c, int pos)
+{
+  str *line;
+
+  if (pos < 1 || pos > gap_length(j))
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  /* a change in place needs no hole, only the line that has one */
+  if (G.chars != NULL && G.line == j)
+    G.chars[pos - 1 < G.start ? pos - 1 : pos - 1 + G.end - G.start] = c;
+  else
+  {
+    line = line_mut(&T, j);
+    if (line == NULL || line_own(line) == MEM_ERROR) return MEM_ERROR;
+    line->chars[pos - 1] = c;
+  }
+
+  modified();
+
+  return 0;
+}
+
+int cmp_range(const void *a, const void *b)
+{
+  const struct range *x = (const struct range*)a;
+  const struct range *y = (const struct range*)b;
+
+  if (x->start != y->start) return x->start < y->start ? -1 : 1;
+  return x->end - y->end;
+}
+
+/* removes the lines covered by ranges (0-based, end exclusive, any order).
+   A few ranges are cut out one by one, each touching only the chunks it
+   is in; many close their gaps in place with one pass over the table */
+int e_dellines(struct range *ranges, int n)
+{
+  struct arraystr rest;
+  struct arraystr gone;
+  str *kept = NULL;
+  int from;
+  int k;
+  int j;
+  int next;
+  int dst = 0;
+  int m = 0;
+
+  if (n < 1) return 0;
+
+  qsort(ranges, n, sizeof(struct range), cmp_range);
+
+  /* merge overlapping and touching ranges */
+  for (k = 1; k < n; k++)
+  {
+    if (ranges[k].start <= ranges[m].end)
+    {
+      if (ranges[k].end > ranges[m].end) ranges[m].end = ranges[k].end;
+    }
+    else
+      ranges[++m] = ranges[k];
+  }
+  n = m + 1;
+
+  /* back to front, so the ranges still to go keep their place */
+  if ((long)n * CHUNK < T.num - ranges[0].start)
+  {
+    for (k = n - 1; k >= 0; k--)
+    {
+      if (text_flat(&T, ranges[k].start, ranges[k].end, &gone) == MEM_ERROR
+          || text_splice(&T, ranges[k].start, gone.num, NULL, 0) == MEM_ERROR)
+      {
+        free(gone.lines);
+        if (k < n - 1) modified();
+        return MEM_ERROR;
+      }
+      for (j = 0; j < gone.num; j++)
+        line_free(gone.lines[j].chars);
+      free(gone.lines);
+    }
+
+    modified();
+    return 0;
+  }
+
+  /* everything from the first deleted line is rebuilt */
+  from = ranges[0].start;
+  if (text_flat(&T, from, T.num, &rest) == MEM_ERROR) return MEM_ERROR;
+  kept = (str*)malloc((rest.num > 0 ? rest.num : 1) * sizeof(str));
+  if (kept == NULL)
+  {
+    free(rest.lines);
+    return MEM_ERROR;
+  }
+
+  for (k = 0; k < n; k++)
+  {
+    next = k + 1 < n ? ranges[k + 1].start : T.num;
+    memcpy(&kept[dst], &rest.lines[ranges[k].end - from], (next - ranges[k].end) * sizeof(str));
+    dst += next - ranges[k].end;
+  }
+
+  if (text_splice(&T, from, T.num - from, kept, dst) == MEM_ERROR)
+  {
+    free(kept);
+    free(rest.lines);
+    return MEM_ERROR;
+  }
+
+  for (k = 0; k < n; k++)
+    for (j = ranges[k].start; j < ranges[k].end; j++)
+      line_free(rest.lines[j - from].chars);
+
+  free(kept);
+  free(rest.lines);
+
+  modified();
+  return 0;
+}
+
+int e_delr(int start, int end)
+{ 
+  struct range r;
+
+  r.start = start < 1 ? 0 : start - 1;
+  r.end = end > T.num ? T.num : end;
+  if (r.start >= r.end) return 0;
+
+  return e_dellines(&r, 1);
+}
+
+/* parses a list like 3,7,10-200 (the pieces may also be separate tokens)
+   into 0-based ranges, returns their number or -1 */
+int parse_lines(struct arraystr *ar, int from, struct range **out)
+{
+  struct range *ranges = NULL;
+  struct range *tmp = NULL;
+  int n = 0;
+  int mem = 0;
+  int k;
+  long a;
+  long b;
+  char *p;
+
+  for (k = from; k < ar->num; k++)
+  {
+    p = ar->lines[k].chars;
+    while (*p != '\0')
+    {
+      if (*p == ',')
+      {
+        p++;
+        continue;
+      }
+
+      a = strtol(p, &p, 10);
+      b = a;
+      if (*p == '-')
+        b = strtol(p + 1, &p, 10);
+
+      if ((*p != ',' && *p != '\0') || a < 1 || b < a)
+      {
+        free(ranges);
+        return -1;
+      }
+
+      if (n == mem)
+      {
+        tmp = (struct range*)realloc(ranges, (mem + BUFFADD) * sizeof(struct range));
+        if (tmp == NULL)
+        {
+          free(ranges);
+          return -1;
+        }
+        ranges = tmp;
+        mem += BUFFADD;
+      }
+      ranges[n].start = a - 1;
+      ranges[n++].end = b;
+    }
+  }
+
+  *out = ranges;
+  return n;
+}
+
+int delete_lines(struct arraystr *ar, int from)
+{
+  struct range *ranges = NULL;
+  int n;
+  int k;
+  int res = 0;
+
+  n = parse_lines(ar, from, &ranges);
+  if (n < 1)
+  {
+    free(ranges);
+    return err_com();
+  }
+
+  for (k = 0; k < n; k++)
+  {
+    if (ranges[k].start >= T.num)
+    {
+      free(ranges);
+      msg("out of bounds\n");
+      return -1;
+    }
+    if (ranges[k].end > T.num) ranges[k].end = T.num;
+  }
+
+  if (B.active)
+  {
+    for (k = 0; k < n && res == 0; k++)
+      res = batch_delete(ranges[k].start + 1, ranges[k].end);
+  }
+  else
+    res = e_dellines(ranges, n);
+
+  free(ranges);
+  return res;
+}
+
+/* BATCHES: between begin and commit, insert after and delete range are
+   queued against the line numbers the text had at begin and applied
+   together by one rebuild of the line table */
+
+int split(struct arraystr *ar, str s)
+{
+  str *tmp = NULL;
+  char *line = NULL;
+  char *nl;
+  int from = 0;
+  int len;
+  int count = 1;
+  int j;
+
+  for (j = 0; j < s.length; j++)
+    if (s.chars[j] == '\n')
+      count++;
+
+  tmp = (str*)realloc(ar->lines, (ar->num + count) * sizeof(str));
+  if (tmp == NULL) return MEM_ERROR;
+  ar->lines = tmp;
+
+  for (j = 0; j < count; j++)
+  {
+    nl = (char*)memchr(&s.chars[from], '\n', s.length - from);
+    len = nl == NULL ? s.length - from : nl - &s.chars[from];
+
+    line = (char*)malloc(len + 1);
+    if (line == NULL) return MEM_ERROR;
+    memcpy(line, &s.chars[from], len);
+    line[len] = '\0';
+
+    ar->lines[ar->num].chars = line;
+    ar->lines[ar->num++].length = len;
+    from += len + 1;
+  }
+
+  return count;
+}
+
+int e_begin()
+{
+  if (B.active)
+  {
+    msg("batch is already open\n");
+    return -1;
+  }
+
+  B.active = 1;
+  B.base = T.num;
+  B.nins = 0;
+  B.ndel = 0;
+  return 0;
+}
+
+/* queues text, which the batch now owns, to go after line pos */
+int batch_queue(int pos, struct arraystr *text)
+{
+  struct insertion *tmp = NULL;
+
+  if (B.nins == B.mins)
+  {
+    tmp = (struct insertion*)realloc(B.ins, (B.mins + BUFFADD) * sizeof(struct insertion));
+    if (tmp == NULL)
+    {
+      release(text);
+      return MEM_ERROR;
+    }
+    B.ins = tmp;
+    B.mins += BUFFADD;
+  }
+
+  B.ins[B.nins].pos = pos;
+  B.ins[B.nins].seq = B.nins;
+  B.ins[B.nins].text = *text;
+  B.nins++;
+
+  modified();
+  return 0;
+}
+
+int batch_insert(str toin, int pos)
+{
+  struct arraystr text = {NULL, 0};
+
+  if (pos < 0 || pos > B.base)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  if (split(&text, toin) == MEM_ERROR)
+  {
+    freear(&text);
+    return MEM_ERROR;
+  }
+
+  return batch_queue(pos, &text);
+}
+
+int batch_delete(int start, int end)
+{
+  struct range *tmp = NULL;
+
+  if (start < 1 || start > B.base || end < start)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  if (B.ndel == B.mdel)
+  {
+    tmp = (struct range*)realloc(B.del, (B.mdel + BUFFADD) * sizeof(struct range));
+    if (tmp == NULL) return MEM_ERROR;
+    B.del = tmp;
+    B.mdel += BUFFADD;
+  }
+
+  B.del[B.ndel].start = start - 1;
+  B.del[B.ndel++].end = end > B.base ? B.base : end;
+
+  modified();
+  return 0;
+}
+
+int cmp_insertion(const void *a, const void *b)
+{
+  const struct insertion *x = (const struct insertion*)a;
+  const struct insertion *y = (const struct insertion*)b;
+
+  if (x->pos != y->pos) return x->pos < y->pos ? -1 : 1;
+  return x->seq - y->seq;
+}
+
+int e_commit()
+{
+  struct arraystr old;
+  str *newlines = NULL;
+  int size;
+  int added = 0;
+  int removed = 0;
+  int reach = 0;
+  int idx = 0;
+  int a = 0;
+  int d = 0;
+  int j;
+  int k;
+
+  if (!B.active)
+  {
+    msg("no open batch\n");
+    return -1;
+  }
+
+  qsort(B.ins, B.nins, sizeof(struct insertion), cmp_insertion);
+  qsort(B.del, B.ndel, sizeof(struct range), cmp_range);
+
+  for (k = 0; k < B.nins; k++)
+    added += B.ins[k].text.num;
+
+  /* lines covered by the union of the deleted ranges */
+  for (k = 0; k < B.ndel; k++)
+  {
+    if (B.del[k].end <= reach) continue;
+    removed += B.del[k].end - (B.del[k].start > reach ? B.del[k].start : reach);
+    reach = B.del[k].end;
+  }
+
+  size = B.base - removed + added;
+  newlines = (str*)malloc((size > 0 ? size : 1) * sizeof(str));
+  if (newlines == NULL) return MEM_ERROR;
+  if (text_flat(&T, 0, T.num, &old) == MEM_ERROR)
+  {
+    free(newlines);
+    return MEM_ERROR;
+  }
+
+  for (j = 0; j <= B.base; j++)
+  {
+    for (; a < B.nins && B.ins[a].pos == j; a++)
+    {
+      memcpy(&newlines[idx], B.ins[a].text.lines, B.ins[a].text.num * sizeof(str));
+      idx += B.ins[a].text.num;
+    }
+
+    if (j == B.base) break;
+
+    while (d < B.ndel && B.del[d].end <= j) d++;
+    if (d >= B.ndel || B.del[d].start > j)
+      newlines[idx++] = old.lines[j];
+  }
+
+  if (text_splice(&T, 0, T.num, newlines, idx) == MEM_ERROR)
+  {
+    free(newlines);
+    free(old.lines);
+    return MEM_ERROR;
+  }
+
+  /* the text holds the new lines now, free the deleted ones */
+  for (k = 0; k < B.nins; k++)
+    free(B.ins[k].text.lines);
+  for (d = 0, j = 0; j < B.base; j++)
+  {
+    while (d < B.ndel && B.del[d].end <= j) d++;
+    if (d < B.ndel && B.del[d].start <= j)
+      line_free(old.lines[j].chars);
+  }
+
+  free(newlines);
+  free(old.lines);
+
+  B.active = 0;
+  B.nins = 0;
+  B.ndel = 0;
+  modified();
+  follow_take(1);
+  return 0;
+}
+
+int e_rollback()
+{
+  int k;
+
+  if (!B.active)
+  {
+    msg("no open batch\n");
+    return -1;
+  }
+
+  for (k = 0; k < B.nins; k++)
+    release(&B.ins[k].text);
+
+  B.active = 0;
+  B.nins = 0;
+  B.ndel = 0;
+  follow_take(1);
+  return 0;
+}
+
+int e_delcom(int mode)
+{
+  //1 pascal 2 shell 3 c 4 c++
+  int j;
+  int i;
+  int quotes = 0;
+  char *tmp = NULL;
+  str *line;
+  struct buffer buf;
+  buf.chars = NULL;
+  buf.len = 0;
+  buf.mem = 0;
+
+  for (j = 0; j < T.num; j++)
+  {
+    for (i = 0; i < line_at(&T, j)->length - 1; i++)
+    {
+      if ((mode <= 2 && line_at(&T, j)->chars[i] == '\'') || (mode >= 2 && line_at(&T, j)->chars[i] == '\"'))
+        quotes = quotes ? 0 : 1;
+      if (!quotes)
+      {
+        if ((mode == 4 && line_at(&T, j)->chars[i] == '/' && line_at(&T, j)->chars[i + 1] == '/')
+           || (mode == 2 && line_at(&T, j)->chars[i] == '#'))
+        {
+          line = line_mut(&T, j);
+          if (line == NULL || line_own(line) == MEM_ERROR) return MEM_ERROR;
+          tmp = (char*)realloc(line->chars, i + 1);
+          if (tmp == NULL) return MEM_ERROR;
+
+          tmp[i] = '\0';
+          line->chars = tmp;
+          line->length = i;
+          modified();
+
+          break;
+        }
+        else if (((mode == 1 && line_at(&T, j)->chars[i] == '(') || (mode == 3 && line_at(&T, j)->chars[i] == '/')) 
+                  && line_at(&T, j)->chars[i + 1] == '*')
+        {
+          int rows;
+          int broke = 0;
+          int start = i;
+          for (rows = 0; j + rows < T.num; rows++)
+          {
+            while (i < line_at(&T, j + rows)->length - 1)
+            {
+              if (line_at(&T, j + rows)->chars[i] == '*' && ((mode == 1 && line_at(&T, j + rows)->chars[i + 1] == ')')
+                  || (mode == 3 && line_at(&T, j + rows)->chars[i + 1] == '/')))
+              {
+                broke = 1;
+                break;
+              }
+              i++;
+            }
+            if (broke) break;
+            i = 0;
+          }
+
+          if (rows == 0)
+          {
+            append(&buf, line_at(&T, j)->chars, start);
+            append(&buf, &line_at(&T, j)->chars[i + 2], line_at(&T, j)->length - i - 2);
+            append(&buf, "\0", 1);
+
+            tmp = (char*)realloc(buf.chars, buf.len);
+            if (tmp == NULL) return MEM_ERROR;
+
+            line = line_mut(&T, j);
+            if (line == NULL) return MEM_ERROR;
+            line_free(line->chars);
+            line->chars = tmp;
+            line->length = buf.len - 1;
+            modified();
+
+            buf.chars = NULL;
+            buf.len = 0;
+            buf.mem = 0;
+          }
+          else
+          {
+            line = line_mut(&T, j);
+            if (line == NULL || line_own(line) == MEM_ERROR) return MEM_ERROR;
+            tmp = (char*)realloc(line->chars, start + 1);
+            if (tmp == NULL) return MEM_ERROR;
+
+            tmp[start] = '\0';
+            line->chars = tmp;
+            line->length = start;
+            modified();
+            
+            if (line_at(&T, j + rows)->length > i + 2)
+              append(&buf, &line_at(&T, j + rows)->chars[i + 2], line_at(&T, j + rows)->length - i - 2);
+            append(&buf, "\0", 1);
+            tmp = (char*)realloc(buf.chars, buf.len);
+            if (tmp == NULL) return MEM_ERROR;
+
+            line = line_mut(&T, j + rows);
+            if (line == NULL) return MEM_ERROR;
+            line_free(line->chars);
+            line->chars = tmp;
+            line->length = buf.len - 1;
+            i = 0;
+
+
+            buf.chars = NULL;
+            buf.len = 0;
+            buf.mem = 0;
+            
+            if (rows > 1)
+              e_delr(j + 2, j + 1 + rows);
+          }
+        }
+
+      }
+    }
+  }
+  return 0;
+}
+
+void e_help()
+{
+  int w = E.wrap;
+  int n = E.numbers;
+  int t = E.tabwidth;
+  E.wrap = 0;
+  E.numbers = 0;
+  E.tabwidth = 4;
+
+  print(1, ahelp.num, &ahelp);
+
+  E.wrap = w;
+  E.numbers = n;
+  E.tabwidth = t;
+}
+
+/* MACROS
+  ________
+*/
+
+/* record keeps the line edits that follow as steps, parsed once, and
+   replay runs them for each line of a range straight on the text, with
+   no tokenizing or dispatch in between */
+
+int copy_str(str *to, str from)
+{
+  to->chars = (char*)malloc(from.length + 1);
+  if (to->chars == NULL) return MEM_ERROR;
+  memcpy(to->chars, from.chars, from.length + 1);
+  to->length = from.length;
+  return 0;
+}
+
+/* parses a command into st when it is a line edit a macro can keep:
+   returns 1 if it is, 0 if it is some other command and -1 for a line
+   edit that cannot be replayed line by line */
+int macro_compile(struct arraystr *ar, struct step *st)
+{
+  int line;
+
+  memset(st, 0, sizeof(*st));
+  if (ar->num == 5 && !strcmp(ar->lines[0].chars, "edit") && !strcmp(ar->lines[1].chars, "string"))
+    st->op = STEP_EDIT;
+  else if (ar->num == 5 && !strcmp(ar->lines[0].chars, "insert") && !strcmp(ar->lines[1].chars, "symbol"))
+    st->op = STEP_SYMBOL;
+  else if (ar->num == 5 && !strcmp(ar->lines[0].chars, "insert") && !strcmp(ar->lines[1].chars, "string"))
+    st->op = STEP_STRING;
+  else if (ar->num > 1 && !strcmp(ar->lines[0].chars, "replace") && !strcmp(ar->lines[1].chars, "substring"))
+  {
+    if (ar->num != 6 || !atoi(ar->lines[2].chars) || !atoi(ar->lines[3].chars)
+        || memchr(ar->lines[5].chars, '\n', ar->lines[5].length) != NULL)
+    {
+      msg("only replace substring X Y within lines can be recorded\n");
+      return -1;
+    }
+    st->op = STEP_REPLACE;
+  }
+  else
+    return 0;
+
+  /* bad commands are left for execute to report */
+  line = atoi(ar->lines[2].chars);
+  if (M.num == 0) M.base = line;
+  st->line = line - M.base;
+
+  if (st->op == STEP_REPLACE)
+  {
+    st->end = atoi(ar->lines[3].chars) - M.base;
+    if (copy_str(&st->find, ar->lines[4]) == MEM_ERROR) return -1;
+    if (copy_str(&st->text, ar->lines[5]) == MEM_ERROR)
+    {
+      free(st->find.chars);
+      return -1;
+    }
+    return 1;
+  }
+
+  st->pos = atoi(ar->lines[3].chars);
+  if (st->op == STEP_STRING)
+    return copy_str(&st->text, ar->lines[4]) == MEM_ERROR ? -1 : 1;
+  st->c = ar->lines[4].chars[0];
+  return 1;
+}
+
+int macro_add(struct step *st)
+{
+  struct step *tmp = NULL;
+
+  if (M.num == M.mem)
+  {
+    tmp = (struct step*)realloc(M.steps, (M.mem + 16) * sizeof(struct step));
+    if (tmp == NULL) return MEM_ERROR;
+    M.steps = tmp;
+    M.mem += 16;
+  }
+  M.steps[M.num++] = *st;
+  return 0;
+}
+
+void macro_drop()
+{
+  int k;
+
+  for (k = 0; k < M.num; k++)
+  {
+    free(M.steps[k].text.chars);
+    free(M.steps[k].find.chars);
+  }
+  free(M.steps);
+  M.steps = NULL;
+  M.num = 0;
+  M.mem = 0;
+}
+
+/* runs the macro for each line from start to end, stopping at the first
+   step that fails */
+int e_replay(int start, int end)
+{
+  struct step *st;
+  int res = 0;
+  int j, k;
+  int line;
+
+  if (M.active)
+  {
+    msg("stop recording first\n");
+    return -1;
+  }
+  if (M.num == 0)
+  {
+    msg("no macro recorded\n");
+    return -1;
+  }
+  if (start < 1 || end > T.num || start > end)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  for (j = start; j <= end && res == 0; j++)
+    for (k = 0; k < M.num && res == 0; k++)
+    {
+      st = &M.steps[k];
+      line = j + st->line;
+      if (line < 1 || line > T.num || (st->op == STEP_REPLACE && (j + st->end < line || j + st->end > T.num)))
+      {
+        msg("out of bounds\n");
+        res = -1;
+      }
+      else if (st->op == STEP_EDIT)
+        res = e_edit(line - 1, st->c, st->pos);
+      else if (st->op == STEP_SYMBOL)
+        res = e_insert_symbol(line - 1, st->c, st->pos);
+      else if (st->op == STEP_STRING)
+        res = e_insert_string(line - 1, st->text, st->pos);
+      else if ((res = gap_close()) == 0)
+        res = e_replace_substr(line, j + st->end, st->find, st->text);
+    }
+
+  if (res != 0)
+    msg("replay stopped at line %d\n", j - 1);
+  return res;
+}
+
+/* FILTERS
+  _________
+*/
+
+/* keep/drop run their predicate on worker threads, each over its own
+   slice of the range, then the survivors are compacted in one pass */
+
+#define WORKERS 16
+#define SLICE 16384
+
+struct slice
+{
+  int from;
+  int to;
+  void *arg;
+};
+
+struct filter
+{
+  int mode;
+  str pattern;
+  regex_t re;
+  int base;
+  char *hit;
+};
+
+/* threads worth using for lines lines: one per online CPU, but no slice
+   shorter than SLICE */
+int workers(int lines)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n > WORKERS) n = WORKERS;
+  if (n > lines / SLICE) n = lines / SLICE;
+  if (n < 1) n = 1;
+
+  return n;
+}
+
+/* splits lines [from, to) into slices of at least SLICE lines and runs fn
+   on each, the last on the calling thread, waiting for all of them */
+void parallel(void *(*fn)(void*), void *arg, int from, int to)
+{
+  struct slice sl[WORKERS];
+  pthread_t th[WORKERS];
+  int n = workers(to - from);
+  int started;
+  int k;
+
+  for (k = 0; k < n; k++)
+  {
+    sl[k].from = from + (long)(to - from) * k / n;
+    sl[k].to = from + (long)(to - from) * (k + 1) / n;
+    sl[k].arg = arg;
+  }
+
+  for (started = 0; started < n - 1; started++)
+    if (spawn_helper(&th[started], fn, &sl[started]) != 0) break;
+
+  /* whatever did not get a thread runs here */
+  for (k = started; k < n; k++)
+    fn(&sl[k]);
+
+  for (k = 0; k < started; k++)
+    pthread_join(th[k], NULL);
+}
+
+void *filter_slice(void *arg)
+{
+  struct slice *sl = (struct slice*)arg;
+  struct filter *f = (struct filter*)sl->arg;
+  regex_t own;
+  regex_t *re = &f->re;
+  int j;
+
+  /* glibc holds a lock on a compiled regex for all of regexec, so a slice
+     compiles its own rather than queue on f->re */
+  if (f->mode == MATCH_REGEX && regcomp(&own, f->pattern.chars, REG_EXTENDED | REG_NOSUB) == 0)
+    re = &own;
+
+  for (j = sl->from; j < sl->to; j++)
+  {
+    if (f->mode == MATCH_REGEX)
+      f->hit[j - f->base] = regexec(re, line_at(&T, j)->chars, 0, NULL, 0) == 0;
+    else
+      f->hit[j - f->base] = idxsubstr(*line_at(&T, j), f->pattern) != -1;
+  }
+
+  if (re == &own) regfree(&own);
+  return arg;
+}
+
+/* keeps (keep = 1) or drops the lines from start to end that contain
+   pattern, or match it as an extended regex in MATCH_REGEX mode */
+int e_filter(int start, int end, str pattern, int mode, int keep)
+{
+  struct filter f;
+  struct arraystr range;
+  char err[BUFSIZ];
+  int dst;
+  int j;
+  int res;
+
+  if (start < 1 || start > T.num || end < start || end > T.num)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  if (pattern.length < 1)
+  {
+    msg("invalid parameter\n");
+    return -1;
+  }
+
+  f.mode = mode;
+  f.pattern = pattern;
+  f.base = start - 1;
+
+  if (mode == MATCH_REGEX && (res = regcomp(&f.re, pattern.chars, REG_EXTENDED | REG_NOSUB)) != 0)
+  {
+    regerror(res, &f.re, err, sizeof(err));
+    msg("bad pattern: %s\n", err);
+    return -1;
+  }
+
+  f.hit = (char*)malloc(end - start + 1);
+  if (f.hit == NULL || text_flat(&T, start - 1, end, &range) == MEM_ERROR)
+  {
+    free(f.hit);
+    if (mode == MATCH_REGEX) regfree(&f.re);
+    return MEM_ERROR;
+  }
+
+  parallel(filter_slice, &f, start - 1, end);
+
+  /* kept lines move to the front of range, the rest follow them */
+  dst = 0;
+  for (j = 0; j < range.num; j++)
+  {
+    if (f.hit[j] == keep)
+    {
+      str line = range.lines[j];
+
+      range.lines[j] = range.lines[dst];
+      range.lines[dst++] = line;
+    }
+  }
+
+  if (dst < range.num)
+  {
+    if (text_splice(&T, start - 1, range.num, range.lines, dst) == MEM_ERROR)
+    {
+      free(range.lines);
+      free(f.hit);
+      if (mode == MATCH_REGEX) regfree(&f.re);
+      return MEM_ERROR;
+    }
+    for (j = dst; j < range.num; j++)
+      line_free(range.lines[j].chars);
+    modified();
+  }
+
+  free(range.lines);
+  free(f.hit);
+  if (mode == MATCH_REGEX) regfree(&f.re);
+  return 0;
+}
+
+/* filter range hands the lines to a child on a helper thread while the
+   calling thread reads the child's output through read_file. Lines are
+   gathered straight from their storage with writev; a line of BLOCK bytes
+   or more is mapped into the pipe with vmsplice instead, for short ones
+   that costs a pipe slot per line and is slower than the copy */
+
+struct feed
+{
+  int fd;
+  int start;
+  int end;
+  int failed;
+};
+
+/* writes out all of iov, picking up where a short write stopped */
+int write_iov(int fd, struct iovec *iov, int n, int map)
+{
+  ssize_t w;
+
+  while (n > 0)
+  {
+#ifdef __linux__
+    w = map ? vmsplice(fd, iov, n, 0) : writev(fd, iov, n);
+    if (w < 0 && map && errno == EINVAL)
+      w = writev(fd, iov, n);
+#else
+    w = writev(fd, iov, n);
+#endif
+    if (w < 0)
+    {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    for (; n > 0 && w >= (ssize_t)iov->iov_len; iov++, n--)
+      w -= iov->iov_len;
+    if (n > 0)
+    {
+      iov->iov_base = (char*)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+
+  return 0;
+}
+
+void *feed_lines(void *arg)
+{
+  struct feed *fe = (struct feed*)arg;
+  struct iovec iov[IOV_MAX];
+  struct iovec big;
+  str *line;
+  int n = 0;
+  int j;
+
+  /* EPIPE: the command stopped reading, its status decides */
+  for (j = fe->start; j < fe->end && !fe->failed; j++)
+  {
+    line = line_at(&T, j);
+    if (line->length >= BLOCK)
+    {
+      big.iov_base = line->chars;
+      big.iov_len = line->length;
+      if (write_iov(fe->fd, iov, n, 0) < 0 || write_iov(fe->fd, &big, 1, 1) < 0)
+        fe->failed = 1;
+      n = 0;
+    }
+    else
+    {
+      iov[n].iov_base = line->chars;
+      iov[n++].iov_len = line->length;
+    }
+    iov[n].iov_base = "\n";
+    iov[n++].iov_len = 1;
+
+    if (n + 2 > IOV_MAX)
+    {
+      if (write_iov(fe->fd, iov, n, 0) < 0) fe->failed = 1;
+      n = 0;
+    }
+  }
+
+  if (!fe->failed && write_iov(fe->fd, iov, n, 0) < 0)
+    fe->failed = 1;
+
+  close(fe->fd);
+  return arg;
+}
+
+/* replaces lines start..end with what command prints when given them on
+   its input; the text is left alone unless the command exits with 0 */
+int e_pipe(int start, int end, char *command)
+{
+  struct arraystr text = {NULL, 0};
+  struct arraystr old;
+  struct feed fe;
+  pthread_t feeder;
+  int in[2];
+  int out[2];
+  int status;
+  int res;
+  int j;
+  pid_t pid;
+
+  if (start < 1 || start > T.num || end < start || end > T.num)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  if (pipe2(in, O_CLOEXEC) < 0) return -1;
+  if (pipe2(out, O_CLOEXEC) < 0)
+  {
+    close(in[0]);
+    close(in[1]);
+    return -1;
+  }
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0)
+  {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+    _exit(127);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  if (pid < 0)
+  {
+    close(in[1]);
+    close(out[0]);
+    msg("failed to start command\n");
+    return -1;
+  }
+
+  fe.fd = in[1];
+  fe.start = start - 1;
+  fe.end = end;
+  fe.failed = 0;
+  if (spawn_helper(&feeder, feed_lines, &fe) != 0)
+  {
+    close(in[1]);
+    fe.fd = -1;
+  }
+
+  res = read_lines(out[0], &text, NULL, NULL);
+  close(out[0]);
+
+  if (fe.fd >= 0)
+    pthread_join(feeder, NULL);
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+
+  if (fe.fd < 0 || res < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    msg("command failed, lines were kept\n");
+    freear(&text);
+    return -1;
+  }
+
+  if (text.lines[text.num - 1].length == 0)
+    free(text.lines[--text.num].chars);
+
+  /* one splice, the old lines are freed only once the new ones are in */
+  if (text_flat(&T, start - 1, end, &old) == MEM_ERROR)
+  {
+    freear(&text);
+    return MEM_ERROR;
+  }
+  if (text_splice(&T, start - 1, old.num, text.lines, text.num) == MEM_ERROR)
+  {
+    free(old.lines);
+    freear(&text);
+    return MEM_ERROR;
+  }
+
+  for (j = 0; j < old.num; j++)
+    line_free(old.lines[j].chars);
+  free(old.lines);
+  free(text.lines);
+  modified();
+  return 0;
+}
+
+/* STATISTICS
+  ____________
+*/
+
+/* stats adds up a tally per chunk, on as many threads as parallel gives
+   it. A chunk keeps its tally until line_mut changes it, so asking again
+   after a few edits only goes through the chunks they touched */
+
+/* whitespace the way wc counts words: space and \t to \r */
+#define IS_BLANK(c) ((c) == ' ' || (unsigned)((unsigned char)(c) - '\t') <= '\r' - '\t')
+
+void tally_line(struct tally *t, str line, int j)
+{
+  const char *s = line.chars;
+  int blank = 1;
+  int i = 0;
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i span = _mm_set1_epi8('\r' - '\t');
+  __m128i v;
+  __m128i d;
+  int ws;
+#endif
+
+  t->bytes += line.length + 1;
+  if (line.length > t->longest)
+  {
+    t->longest = line.length;
+    t->at = j;
+  }
+
+#ifdef __SSE2__
+  /* a word starts at a byte that is not blank after one that is */
+  for (; i + 16 <= line.length; i += 16)
+  {
+    v = _mm_loadu_si128((const __m128i*)&s[i]);
+    d = _mm_sub_epi8(v, tab);
+    ws = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, space),
+                                        _mm_cmpeq_epi8(_mm_min_epu8(d, span), d)));
+    t->tabs += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, tab)));
+    t->words += __builtin_popcount(~ws & ((ws << 1) | blank) & 0xffff);
+    blank = (ws >> 15) & 1;
+  }
+#endif
+
+  for (; i < line.length; i++)
+  {
+    if (s[i] == '\t') t->tabs++;
+    if (!IS_BLANK(s[i]) && blank) t->words++;
+    blank = IS_BLANK(s[i]);
+  }
+}
+
+/* adds u, which counted lines from line base on, to t; the longest
+   line is the first one of that length */
+void tally_add(struct tally *t, struct tally *u, int base)
+{
+  if (u->lines > 0 && (t->lines == 0 || u->longest > t->longest))
+  {
+    t->longest = u->longest;
+    t->at = base + u->at;
+  }
+  t->lines += u->lines;
+  t->bytes += u->bytes;
+  t->words += u->words;
+  t->tabs += u->tabs;
+}
+
+/* adds lines [from, to) of T to t one by one */
+void tally_lines(struct tally *t, int from, int to)
+{
+  struct tally part;
+  int j;
+
+  memset(&part, 0, sizeof(part));
+  for (j = from; j < to; j++)
+    tally_line(&part, *line_at(&T, j), j - from);
+  part.lines = to > from ? to - from : 0;
+  tally_add(t, &part, from);
+}
+
+/* counts the chunks that start in the slice and have no tally yet */
+void *stats_slice(void *arg)
+{
+  struct slice *sl = (struct slice*)arg;
+  struct text *t = (struct text*)sl->arg;
+  struct chunk *c;
+  int k;
+  int j;
+
+  k = chunk_of(t->tab, sl->from);
+  if (t->tab->start[k] < sl->from) k++;
+  for (; k < t->tab->n && t->tab->start[k] < sl->to; k++)
+  {
+    c = t->tab->chunks[k];
+    if (c->summed) continue;
+
+    memset(&c->sum, 0, sizeof(struct tally));
+    c->sum.lines = c->count;
+    for (j = 0; j < c->sum.lines; j++)
+      tally_line(&c->sum, *line_at(t, t->tab->start[k] + j), j);
+    c->summed = 1;
+  }
+
+  return arg;
+}
+
+/* stats of lines [start, end): the whole chunks in it by their tallies,
+   the lines around them one by one */
+void e_stats(int start, int end)
+{
+  struct tally all;
+  int first = 0;
+  int last = 0;
+  int step = E.budget > 0 ? WORKERS * SLICE : INT_MAX;
+  int head = 0;
+  int tail = 0;
+  int from;
+  int k;
+
+  memset(&all, 0, sizeof(all));
+  if (T.num > 0 && start < T.num)
+  {
+    first = chunk_of(T.tab, start);
+    if (T.tab->start[first] < start) first++;
+    last = end == T.num ? T.tab->n : chunk_of(T.tab, end);
+    head = T.tab->start[first];
+    tail = T.tab->start[last];
+  }
+  if (first >= last)
+  {
+    first = last = 0;
+    head = tail = end;
+  }
+
+  tally_lines(&all, start, head);
+
+  /* under a memory budget a window at a time, squeezing after each */
+  for (from = head; from < tail; from += tail - from > step ? step : tail - from)
+  {
+    parallel(stats_slice, &T, from, tail - from > step ? from + step : tail);
+    squeeze_grown(&T);
+  }
+  for (k = first; k < last; k++)
+    tally_add(&all, &T.tab->chunks[k]->sum, T.tab->start[k]);
+
+  tally_lines(&all, tail, end);
+
+  fprintf(output(), "lines: %ld, bytes: %ld\n", all.lines, all.bytes);
+  fprintf(output(), "longest line: %d (%d bytes), words: %ld, tabs: %ld\n",
+          all.lines > 0 ? all.at + 1 : 0, all.longest, all.words, all.tabs);
+  if (start == 0 && end == T.num)
+    intern_stats(all.bytes);
+}
+
+/* DIFF
+  ______
+*/
+
+/* diff shows how T differs from its file on disk as a unified diff.
+   Lines are hashed 8 bytes at a time on the filter threads, the same
+   head and tail are cut off and every line left gets a number, equal
+   lines the same one. The lines unique on both sides and in the same
+   order anchor the match, patience style, and Myers only runs on the
+   stretches between anchors, where it is cheap. A stretch that would
+   still cost too much is shown as all changed */
+
+#define DIFF_CONTEXT 3
+#define DIFF_COST (1L << 26)
+#define NOEOL "\\ No newline at end of file"
+
+/* a, n lines, is the file and b, m lines, T. A last line that is empty
+   only ends the one before with a newline and is left out; any other is
+   noeol, as diff calls it. head and tail lines are the same at both ends.
+   del and ins mark what the match leaves out of each */
+struct differ
+{
+  str *a;
+  int noeol_a;
+  int noeol_b;
+  int head;
+  int tail;
+  uint64_t *ha;
+  uint64_t *hb;
+  int *ia;
+  int *ib;
+  int n;
+  int m;
+  char *del;
+  char *ins;
+  int *ca;
+  int *cb;
+  int *pb;
+  int *v1;
+  int *v2;
+};
+
+uint64_t line_hash(str line)
+{
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ line.length;
+  uint64_t w;
+  int i;
+
+  for (i = 0; i + 8 <= line.length; i += 8)
+  {
+    memcpy(&w, &line.chars[i], 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  w = 0;
+  memcpy(&w, &line.chars[i], line.length - i);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
+
+void *hash_file_slice(void *arg)
+{
+  struct slice *sl = (struct slice*)arg;
+  struct differ *d = (struct differ*)sl->arg;
+  int j;
+
+  for (j = sl->from; j < sl->to; j++)
+    d->ha[j] = line_hash(d->a[j]);
+  return arg;
+}
+
+void *hash_text_slice(void *arg)
+{
+  struct slice *sl = (struct slice*)arg;
+  struct differ *d = (struct differ*)sl->arg;
+  int j;
+
+  for (j = sl->from; j < sl->to; j++)
+    d->hb[j] = line_hash(*line_at(&T, j));
+  return arg;
+}
+
+/* whether line x of the file and y of T are the same, newline and all */
+int diff_same(struct differ *d, int x, int y)
+{
+  str *a = &d->a[x];
+  str *b;
+
+  if (d->ha[x] != d->hb[y] || (d->noeol_a && x == d->n - 1) != (d->noeol_b && y == d->m - 1))
+    return 0;
+  b = line_at(&T, y);
+  return a->length == b->length && !memcmp(a->chars, b->chars, a->length);
+}
+
+/* numbers the lines of both sides between the common head and tail,
+   equal lines alike, through a table open addressed by hash; returns
+   how many numbers it gave. Unless strict the hash alone is trusted,
+   so the table stays small and the lines are not touched again; e_diff
+   checks the match it gets and comes back strict if a hash lied */
+int diff_number(struct differ *d, int strict)
+{
+  struct dslot
+  {
+    uint64_t h;
+    int id;
+    int at;
+  } *tab;
+  int na = d->n - d->tail - d->head;
+  int total = na + d->m - d->tail - d->head;
+  str *line;
+  uint64_t h;
+  long mem = 16;
+  long s;
+  int ids = 0;
+  int j, k;
+
+  while (mem < 2L * total) mem *= 2;
+  tab = (struct dslot*)malloc(mem * sizeof(struct dslot));
+  if (tab == NULL) return MEM_ERROR;
+  for (s = 0; s < mem; s++)
+    tab[s].id = -1;
+
+  for (j = 0; j < total; j++)
+  {
+#ifdef __GNUC__
+    /* the probes miss the cache, start the ones a few lines on early */
+    if (j + 8 < total)
+    {
+      k = j + 8 < na ? d->head + j + 8 : d->head + j + 8 - na;
+      __builtin_prefetch(&tab[(j + 8 < na ? d->ha[k] : d->hb[k]) & (mem - 1)]);
+    }
+#endif
+    k = j < na ? d->head + j : d->head + j - na;
+    h = j < na ? d->ha[k] : d->hb[k];
+    line = !strict ? NULL : j < na ? &d->a[k] : line_at(&T, k);
+
+    for (s = h & (mem - 1); tab[s].id >= 0; s = (s + 1) & (mem - 1))
+      if (tab[s].h == h)
+      {
+        if (!strict) break;
+        if (tab[s].at < na)
+        {
+          if (d->a[d->head + tab[s].at].length == line->length
+              && !memcmp(d->a[d->head + tab[s].at].chars, line->chars, line->length))
+            break;
+        }
+        else if (line_at(&T, d->head + tab[s].at - na)->length == line->length
+                 && !memcmp(line_at(&T, d->head + tab[s].at - na)->chars, line->chars, line->length))
+          break;
+      }
+    if (tab[s].id < 0)
+    {
+      tab[s].h = h;
+      tab[s].at = j;
+      tab[s].id = ids++;
+    }
+
+    if (j < na) d->ia[k] = tab[s].id;
+    else d->ib[k] = tab[s].id;
+  }
+
+  free(tab);
+  return ids;
+}
+
+void diff_all(struct differ *d, int a0, int a1, int b0, int b1)
+{
+  memset(&d->del[a0], 1, a1 - a0);
+  memset(&d->ins[b0], 1, b1 - b0);
+}
+
+/* Myers' O(ND) search from both ends at once, splitting a0..a1 and b0..b1
+   where the two meet and going on with each half */
+void diff_myers(struct differ *d, int a0, int a1, int b0, int b1)
+{
+  int *a;
+  int *b;
+  int n;
+  int m;
+  int max;
+  int delta;
+  int front;
+  int k1start = 0;
+  int k1end = 0;
+  int k2start = 0;
+  int k2end = 0;
+  int x1, y1, x2, y2;
+  int k1, k2;
+  int o;
+  int dd;
+  long cost = 0;
+
+  while (a0 < a1 && b0 < b1 && d->ia[a0] == d->ib[b0])
+  {
+    a0++;
+    b0++;
+  }
+  while (a0 < a1 && b0 < b1 && d->ia[a1 - 1] == d->ib[b1 - 1])
+  {
+    a1--;
+    b1--;
+  }
+  if (a0 == a1 || b0 == b1)
+  {
+    diff_all(d, a0, a1, b0, b1);
+    return;
+  }
+
+  a = &d->ia[a0];
+  b = &d->ib[b0];
+  n = a1 - a0;
+  m = b1 - b0;
+  max = (n + m + 1) / 2;
+  delta = n - m;
+  front = delta % 2 != 0;
+
+  for (o = 0; o < 2 * max + 2; o++)
+    d->v1[o] = d->v2[o] = -1;
+  d->v1[max + 1] = 0;
+  d->v2[max + 1] = 0;
+
+  for (dd = 0; dd < max; dd++)
+  {
+    /* past the cost of a diff worth reading, the stretch is all changed */
+    cost += n + m;
+    if (cost > DIFF_COST) break;
+
+    for (k1 = -dd + k1start; k1 <= dd - k1end; k1 += 2)
+    {
+      o = max + k1;
+      if (k1 == -dd || (k1 != dd && d->v1[o - 1] < d->v1[o + 1]))
+        x1 = d->v1[o + 1];
+      else
+        x1 = d->v1[o - 1] + 1;
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m && a[x1] == b[y1])
+      {
+        x1++;
+        y1++;
+      }
+      d->v1[o] = x1;
+
+      if (x1 > n)
+        k1end += 2;
+      else if (y1 > m)
+        k1start += 2;
+      else if (front)
+      {
+        o = max + delta - k1;
+        if (o >= 0 && o < 2 * max + 2 && d->v2[o] != -1 && x1 >= n - d->v2[o])
+        {
+          diff_myers(d, a0, a0 + x1, b0, b0 + y1);
+          diff_myers(d, a0 + x1, a1, b0 + y1, b1);
+          return;
+        }
+      }
+    }
+
+    for (k2 = -dd + k2start; k2 <= dd - k2end; k2 += 2)
+    {
+      o = max + k2;
+      if (k2 == -dd || (k2 != dd && d->v2[o - 1] < d->v2[o + 1]))
+        x2 = d->v2[o + 1];
+      else
+        x2 = d->v2[o - 1] + 1;
+      y2 = x2 - k2;
+      while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1])
+      {
+        x2++;
+        y2++;
+      }
+      d->v2[o] = x2;
+
+      if (x2 > n)
+        k2end += 2;
+      else if (y2 > m)
+        k2start += 2;
+      else if (!front)
+      {
+        o = max + delta - k2;
+        if (o >= 0 && o < 2 * max + 2 && d->v1[o] != -1)
+        {
+          x1 = d->v1[o];
+          y1 = max + x1 - o;
+          if (x1 >= n - x2)
+          {
+            diff_myers(d, a0, a0 + x1, b0, b0 + y1);
+            diff_myers(d, a0 + x1, a1, b0 + y1, b1);
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  diff_all(d, a0, a1, b0, b1);
+}
+
+/* matches a0..a1 with b0..b1: the lines found once on each side, in
+   the longest run that keeps their order, are kept as they are and the
+   stretches between them matched the same way, down to Myers */
+int diff_patience(struct differ *d, int a0, int a1, int b0, int b1)
+{
+  int *pairs = NULL;
+  int *tops = NULL;
+  int *prev = NULL;
+  int npairs = 0;
+  int ntops = 0;
+  int lo, hi, mid;
+  int res = 0;
+  int j, k;
+
+  while (a0 < a1 && b0 < b1 && d->ia[a0] == d->ib[b0])
+  {
+    a0++;
+    b0++;
+  }
+  while (a0 < a1 && b0 < b1 && d->ia[a1 - 1] == d->ib[b1 - 1])
+  {
+    a1--;
+    b1--;
+  }
+  if (a0 == a1 || b0 == b1)
+  {
+    diff_all(d, a0, a1, b0, b1);
+    return 0;
+  }
+
+  for (j = a0; j < a1; j++)
+    d->ca[d->ia[j]]++;
+  for (j = b0; j < b1; j++)
+  {
+    d->cb[d->ib[j]]++;
+    d->pb[d->ib[j]] = j;
+  }
+
+  /* each pair is its place in a and then in b */
+  pairs = (int*)malloc(2 * (a1 - a0) * sizeof(int));
+  if (pairs == NULL) res = MEM_ERROR;
+  for (j = a0; j < a1 && res == 0; j++)
+    if (d->ca[d->ia[j]] == 1 && d->cb[d->ia[j]] == 1)
+    {
+      pairs[2 * npairs] = j;
+      pairs[2 * npairs++ + 1] = d->pb[d->ia[j]];
+    }
+
+  for (j = a0; j < a1; j++)
+    d->ca[d->ia[j]] = 0;
+  for (j = b0; j < b1; j++)
+    d->cb[d->ib[j]] = 0;
+
+  if (res == 0 && npairs == 0)
+  {
+    free(pairs);
+    diff_myers(d, a0, a1, b0, b1);
+    return 0;
+  }
+
+  /* longest increasing run of their places in b, patience sorted */
+  tops = (int*)malloc(npairs * sizeof(int));
+  prev = (int*)malloc(npairs * sizeof(int));
+  if (res != 0 || tops == NULL || prev == NULL)
+  {
+    free(pairs);
+    free(tops);
+    free(prev);
+    return MEM_ERROR;
+  }
+
+  for (j = 0; j < npairs; j++)
+  {
+    /* mostly the texts agree and each pair goes on a new pile */
+    lo = ntops > 0 && pairs[2 * tops[ntops - 1] + 1] < pairs[2 * j + 1] ? ntops : 0;
+    hi = ntops;
+    while (lo < hi)
+    {
+      mid = (lo + hi) / 2;
+      if (pairs[2 * tops[mid] + 1] < pairs[2 * j + 1]) lo = mid + 1;
+      else hi = mid;
+    }
+    prev[j] = lo > 0 ? tops[lo - 1] : -1;
+    tops[lo] = j;
+    if (lo == ntops) ntops++;
+  }
+
+  /* the run backwards into tops, then the stretches around each anchor */
+  k = ntops;
+  for (j = tops[ntops - 1]; j >= 0; j = prev[j])
+    tops[--k] = j;
+
+  for (k = 0; k < ntops && res == 0; k++)
+  {
+    j = tops[k];
+    if (a0 < pairs[2 * j] || b0 < pairs[2 * j + 1])
+      res = diff_patience(d, a0, pairs[2 * j], b0, pairs[2 * j + 1]);
+    a0 = pairs[2 * j] + 1;
+    b0 = pairs[2 * j + 1] + 1;
+  }
+  if (res == 0)
+    res = diff_patience(d, a0, a1, b0, b1);
+
+  free(pairs);
+  free(tops);
+  free(prev);
+  return res;
+}
+
+/* numbers the lines between head and tail and matches them */
+int diff_match(struct differ *d, int strict)
+{
+  int ids = diff_number(d, strict);
+
+  if (ids == MEM_ERROR) return MEM_ERROR;
+  free(d->ca);
+  free(d->cb);
+  free(d->pb);
+  d->ca = (int*)calloc(ids + 1, sizeof(int));
+  d->cb = (int*)calloc(ids + 1, sizeof(int));
+  d->pb = (int*)malloc((ids + 1) * sizeof(int));
+  if (d->ca == NULL || d->cb == NULL || d->pb == NULL) return MEM_ERROR;
+  return diff_patience(d, d->head, d->n - d->tail, d->head, d->m - d->tail);
+}
+
+/* whether every pair of lines the match keeps is really the same */
+int diff_check(struct differ *d)
+{
+  int x = d->head;
+  int y = d->head;
+
+  while (x < d->n - d->tail || y < d->m - d->tail)
+  {
+    if (x < d->n - d->tail && d->del[x]) x++;
+    else if (y < d->m - d->tail && d->ins[y]) y++;
+    else if (!diff_same(d, x++, y++)) return 0;
+  }
+  return 1;
+}
+
+/* puts c and line into out as a line of the diff */
+int diff_push(struct arraystr *out, int *mem, buffer *tmp, char c, str *line)
+{
+  tmp->len = 0;
+  if (append(tmp, &c, 1) == MEM_ERROR || append(tmp, line->chars, line->length) == MEM_ERROR)
+    return MEM_ERROR;
+  return push_line(out, mem, tmp->chars, tmp->len);
+}
+
+/* the hunks of a unified diff, DIFF_CONTEXT lines around each change and
+   changes closer than twice that in one hunk */
+int diff_hunks(struct differ *d, struct arraystr *out, int *mem)
+{
+  buffer tmp = NEWBUF;
+  char head[64];
+  int i = 0;
+  int j = 0;
+  int sa, sb, ea, eb;
+  int x, y;
+  int k;
+  int res = 0;
+
+  while (res == 0)
+  {
+    while (i < d->n && j < d->m && !d->del[i] && !d->ins[j])
+    {
+      i++;
+      j++;
+    }
+    if (i >= d->n && j >= d->m) break;
+
+    sa = i > DIFF_CONTEXT ? i - DIFF_CONTEXT : 0;
+    sb = j - (i - sa);
+    ea = i;
+    eb = j;
+    while (1)
+    {
+      while (ea < d->n && d->del[ea]) ea++;
+      while (eb < d->m && d->ins[eb]) eb++;
+      for (k = 0; ea + k < d->n && eb + k < d->m && !d->del[ea + k] && !d->ins[eb + k]; k++)
+        ;
+      if ((ea + k >= d->n && eb + k >= d->m) || k > 2 * DIFF_CONTEXT)
+        break;
+      ea += k;
+      eb += k;
+    }
+    i = ea + k;
+    j = eb + k;
+    k = k < DIFF_CONTEXT ? k : DIFF_CONTEXT;
+    ea += k;
+    eb += k;
+
+    /* an empty side is counted from the line before it, as diff -u does */
+    x = sprintf(head, "@@ -%d", ea - sa > 0 ? sa + 1 : sa);
+    if (ea - sa != 1) x += sprintf(head + x, ",%d", ea - sa);
+    x += sprintf(head + x, " +%d", eb - sb > 0 ? sb + 1 : sb);
+    if (eb - sb != 1) x += sprintf(head + x, ",%d", eb - sb);
+    x += sprintf(head + x, " @@");
+    res = push_line(out, mem, head, x);
+
+    for (x = sa, y = sb; res == 0 && (x < ea || y < eb); )
+    {
+      if (x < ea && d->del[x])
+      {
+        res = diff_push(out, mem, &tmp, '-', &d->a[x++]);
+        if (res == 0 && x == d->n && d->noeol_a) res = push_line(out, mem, NOEOL, strlen(NOEOL));
+      }
+      else if (y < eb && d->ins[y])
+      {
+        res = diff_push(out, mem, &tmp, '+', line_at(&T, y++));
+        if (res == 0 && y == d->m && d->noeol_b) res = push_line(out, mem, NOEOL, strlen(NOEOL));
+      }
+      else
+      {
+        res = diff_push(out, mem, &tmp, ' ', &d->a[x++]);
+        if (res == 0 && x == d->n && d->noeol_a) res = push_line(out, mem, NOEOL, strlen(NOEOL));
+        y++;
+      }
+    }
+  }
+
+  free(tmp.chars);
+  return res;
+}
+
+void diff_free(struct differ *d)
+{
+  free(d->ha);
+  free(d->hb);
+  free(d->ia);
+  free(d->ib);
+  free(d->del);
+  free(d->ins);
+  free(d->ca);
+  free(d->cb);
+  free(d->pb);
+  free(d->v1);
+  free(d->v2);
+}
+
+/* diff of filename, as it is on disk, and T, shown like help is */
+int e_diff(char *filename)
+{
+  struct differ d;
+  struct arraystr file = {NULL, 0};
+  struct arraystr diff = {NULL, 0};
+  struct text view = {NULL, 0, 0};
+  buffer head = NEWBUF;
+  int mem = 0;
+  int res = 0;
+  int fd;
+  int w = E.wrap;
+  int n = E.numbers;
+
+  if (filename == NULL)
+  {
+    msg("file name is not associated\n");
+    return -1;
+  }
+
+  /* a background write may be halfway through this very file */
+  if (W.pending)
+    save_wait();
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    msg("failed to open file\n");
+    return -1;
+  }
+  res = read_file(fd, &file) < 0 ? -1 : 0;
+  close(fd);
+  if (res != 0)
+  {
+    release(&file);
+    return -1;
+  }
+
+  memset(&d, 0, sizeof(d));
+  d.a = file.lines;
+  d.n = file.num;
+  d.m = T.num;
+  if (d.n > 0 && d.a[d.n - 1].length == 0) d.n--;
+  else d.noeol_a = d.n > 0;
+  if (d.m > 0 && line_at(&T, d.m - 1)->length == 0) d.m--;
+  else d.noeol_b = d.m > 0;
+  d.ha = (uint64_t*)malloc((d.n + 1) * sizeof(uint64_t));
+  d.hb = (uint64_t*)malloc((d.m + 1) * sizeof(uint64_t));
+  d.ia = (int*)malloc((d.n + 1) * sizeof(int));
+  d.ib = (int*)malloc((d.m + 1) * sizeof(int));
+  d.del = (char*)calloc(d.n + 1, 1);
+  d.ins = (char*)calloc(d.m + 1, 1);
+  d.v1 = (int*)malloc((d.n + d.m + 3) * sizeof(int));
+  d.v2 = (int*)malloc((d.n + d.m + 3) * sizeof(int));
+  if (d.ha == NULL || d.hb == NULL || d.ia == NULL || d.ib == NULL || d.del == NULL
+      || d.ins == NULL || d.v1 == NULL || d.v2 == NULL)
+    res = MEM_ERROR;
+
+  if (res == 0)
+  {
+    parallel(hash_file_slice, &d, 0, d.n);
+    parallel(hash_text_slice, &d, 0, d.m);
+    /* a last line with no newline should not meet its like with one */
+    if (d.noeol_a) d.ha[d.n - 1] = ~d.ha[d.n - 1];
+    if (d.noeol_b) d.hb[d.m - 1] = ~d.hb[d.m - 1];
+    while (d.head < d.n && d.head < d.m && diff_same(&d, d.head, d.head))
+      d.head++;
+    while (d.tail < d.n - d.head && d.tail < d.m - d.head
+           && diff_same(&d, d.n - 1 - d.tail, d.m - 1 - d.tail))
+      d.tail++;
+  }
+  if (res == 0)
+    res = diff_match(&d, 0);
+  if (res == 0 && !diff_check(&d))
+  {
+    memset(d.del, 0, d.n + 1);
+    memset(d.ins, 0, d.m + 1);
+    res = diff_match(&d, 1);
+  }
+
+  if (res == 0)
+  {
+    head.len = 0;
+    if (append(&head, "--- ", 4) == MEM_ERROR || append(&head, filename, strlen(filename)) == MEM_ERROR
+        || append(&head, "\t(on disk)", 10) == MEM_ERROR || push_line(&diff, &mem, head.chars, head.len) == MEM_ERROR)
+      res = MEM_ERROR;
+    else
+    {
+      memset(head.chars, '+', 3);
+      head.len -= 10;
+      if (append(&head, "\t(in the editor)", 16) == MEM_ERROR
+          || push_line(&diff, &mem, head.chars, head.len) == MEM_ERROR)
+        res = MEM_ERROR;
+    }
+  }
+  if (res == 0)
+    res = diff_hunks(&d, &diff, &mem);
+  if (res == 0 && diff.num == 2)
+    fprintf(output(), "no differences\n");
+
+  if (res == 0 && diff.num > 2 && text_insert(&view, 0, &diff) == 0)
+  {
+    E.wrap = 0;
+    E.numbers = 0;
+    res = print(1, view.num, &view);
+    E.wrap = w;
+    E.numbers = n;
+  }
+
+  free(head.chars);
+  text_release(&view);
+  freear(&diff);
+  release(&file);
+  diff_free(&d);
+  return res;
+}
+
+/* SORTING
+  _________
+*/
+
+/* sort and uniq move the str descriptors of T, never the bytes.
+   Slices are merge sorted on worker threads, then merged pairwise. The
+   order (and for uniq the dropped lines) before the last one is kept
+   so undo can put it back while no other edit came in between */
+
+struct entry
+{
+  str line;
+  double key;
+};
+
+struct sorter
+{
+  struct entry *e;
+  struct entry *tmp;
+  int flags;
+};
+
+int cmp_lexical(str a, str b)
+{
+  int res = memcmp(a.chars, b.chars, a.length < b.length ? a.length : b.length);
+
+  if (res) return res;
+  return a.length - b.length;
+}
+
+int cmp_entry(struct entry *a, struct entry *b, int flags)
+{
+  int res = 0;
+
+  /* nan is unordered, those lines go after all numbers */
+  if ((flags & SORT_NUMERIC) && isnan(a->key) != isnan(b->key))
+    res = isnan(a->key) ? 1 : -1;
+  else if ((flags & SORT_NUMERIC) && !isnan(a->key) && a->key != b->key)
+    res = a->key < b->key ? -1 : 1;
+  else
+    res = cmp_lexical(a->line, b->line);
+
+  return (flags & SORT_REVERSE) ? -res : res;
+}
+
+/* merges the sorted runs src[from, mid) and src[mid, to) into dst */
+void merge(struct entry *src, struct entry *dst, int from, int mid, int to, int flags)
+{
+  int i = from;
+  int j = mid;
+  int k = from;
+
+  while (i < mid && j < to)
+  {
+    if (cmp_entry(&src[j], &src[i], flags) < 0)
+      dst[k++] = src[j++];
+    else
+      dst[k++] = src[i++];
+  }
+  memcpy(&dst[k], &src[i], (mid - i) * sizeof(struct entry));
+  k += mid - i;
+  memcpy(&dst[k], &src[j], (to - j) * sizeof(struct entry));
+}
+
+/* sorts e[from, to) using tmp[from, to) as scratch */
+void merge_sort(struct entry *e, struct entry *tmp, int from, int to, int flags)
+{
+  int mid;
+
+  if (to - from < 2) return;
+
+  mid = from + (to - from) / 2;
+  merge_sort(e, tmp, from, mid, flags);
+  merge_sort(e, tmp, mid, to, flags);
+
+  if (cmp_entry(&e[mid], &e[mid - 1], flags) >= 0) return;
+
+  merge(e, tmp, from, mid, to, flags);
+  memcpy(&e[from], &tmp[from], (to - from) * sizeof(struct entry));
+}
+
+void *sort_slice(void *arg)
+{
+  struct slice *sl = (struct slice*)arg;
+  struct sorter *so = (struct sorter*)sl->arg;
+  int j;
+
+  for (j = sl->from; j < sl->to; j++)
+  {
+    so->e[j].key = 0;
+    if (so->flags & SORT_NUMERIC)
+      so->e[j].key = strtod(so->e[j].line.chars, NULL);
+  }
+
+  merge_sort(so->e, so->tmp, sl->from, sl->to, so->flags);
+  return arg;
+}
+
+/* forgets the undo record, freeing the lines only it still holds */
+void undo_drop()
+{
+  free(U.before);
+  U.before = NULL;
+  U.num = 0;
+  release(&U.dropped);
+}
+
+/* remembers lines start..end (0-based, end exclusive) as they are now */
+int undo_save(int start, int end)
+{
+  struct arraystr before;
+
+  undo_drop();
+
+  if (text_flat(&T, start, end, &before) == MEM_ERROR) return MEM_ERROR;
+
+  U.before = before.lines;
+  U.num = before.num;
+  U.start = start;
+  return 0;
+}
+
+int e_sort(int start, int end, int flags)
+{
+  struct sorter so;
+  str *sorted;
+  int n = end - start + 1;
+  int runs;
+  int width;
+  int k;
+  int j;
+
+  if (start < 1 || start > T.num || end < start || end > T.num)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  so.flags = flags;
+  so.e = (struct entry*)malloc(n * sizeof(struct entry));
+  so.tmp = (struct entry*)malloc(n * sizeof(struct entry));
+  if (so.e == NULL || so.tmp == NULL || undo_save(start - 1, end) == MEM_ERROR)
+  {
+    free(so.e);
+    free(so.tmp);
+    return MEM_ERROR;
+  }
+
+  for (j = 0; j < n; j++)
+    so.e[j].line = U.before[j];
+
+  runs = workers(n);
+  parallel(sort_slice, &so, 0, n);
+
+  /* the slices parallel() sorted, merged pairwise */
+  for (width = 1; width < runs; width *= 2)
+  {
+    for (k = 0; k + width < runs; k += 2 * width)
+    {
+      int from = (long)n * k / runs;
+      int mid = (long)n * (k + width) / runs;
+      int to = k + 2 * width < runs ? (long)n * (k + 2 * width) / runs : n;
+
+      merge(so.e, so.tmp, from, mid, to, flags);
+      memcpy(&so.e[from], &so.tmp[from], (to - from) * sizeof(struct entry));
+    }
+  }
+
+  /* so.tmp is free scratch by now, the sorted descriptors go there */
+  sorted = (str*)so.tmp;
+  for (j = 0; j < n; j++)
+    sorted[j] = so.e[j].line;
+  free(so.e);
+
+  if (text_splice(&T, start - 1, n, sorted, n) == MEM_ERROR)
+  {
+    free(so.tmp);
+    undo_drop();
+    return MEM_ERROR;
+  }
+  free(so.tmp);
+
+  modified();
+  U.count = n;
+  U.gen = E.gen;
+  return 0;
+}
+
+/* drops lines of the range equal to the line before them */
+int e_uniq(int start, int end)
+{
+  str *tmp = NULL;
+  str *kept = NULL;
+  int n = end - start + 1;
+  int dst;
+  int j;
+
+  if (start < 1 || start > T.num || end < start || end > T.num)
+  {
+    msg("out of bounds\n");
+    return -1;
+  }
+
+  if (undo_save(start - 1, end) == MEM_ERROR) return MEM_ERROR;
+
+  tmp = (str*)malloc(n * sizeof(str));
+  kept = (str*)malloc(n * sizeof(str));
+  if (tmp == NULL || kept == NULL)
+  {
+    free(tmp);
+    free(kept);
+    return MEM_ERROR;
+  }
+  U.dropped.lines = tmp;
+
+  kept[0] = U.before[0];
+  dst = 1;
+  for (j = 1; j < n; j++)
+  {
+    if (cmp_lexical(U.before[j], kept[dst - 1]) == 0)
+      U.dropped.lines[U.dropped.num++] = U.before[j];
+    else
+      kept[dst++] = U.before[j];
+  }
+
+  if (U.dropped.num > 0 && text_splice(&T, start - 1, n, kept, dst) == MEM_ERROR)
+  {
+    free(kept);
+    U.dropped.num = 0;
+    undo_drop();
+    return MEM_ERROR;
+  }
+  free(kept);
+
+  if (U.dropped.num > 0) modified();
+  U.count = dst;
+  U.gen = E.gen;
+  return 0;
+}
+
+/* puts back the order and lines the last sort or uniq changed */
+int e_undo()
+{
+  if (U.before == NULL)
+  {
+    msg("nothing to undo\n");
+    return -1;
+  }
+
+  if (U.gen != E.gen)
+  {
+    msg("text was edited since the last sort or uniq, unable to undo\n");
+    undo_drop();
+    return -1;
+  }
+
+  if (text_splice(&T, U.start, U.count, U.before, U.num) == MEM_ERROR)
+    return MEM_ERROR;
+
+  /* the dropped lines are back in T */
+  free(U.dropped.lines);
+  U.dropped.lines = NULL;
+  U.dropped.num = 0;
+  undo_drop();
+
+  modified();
+  return 0;
+}
+
+/* UTF-8
+  ______
+*/
+
+#define REPLACEMENT "\xEF\xBF\xBD"
+
+struct interval
+{
+  int first;
+  int last;
+};
+
+static const struct interval zero_width[] =
+{
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x0900, 0x0902}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D},
+  {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF},
+  {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064},
+  {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+  {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0001, 0xE007F}, {0xE0100, 0xE01EF}
+};
+
+static const struct interval wide[] =
+{
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x26AA, 0x26AB},
+  {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26F2, 0x26F5}, {0x2705, 0x2705},
+  {0x270A, 0x270B}, {0x2753, 0x2755}, {0x2795, 0x2797}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+  {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x18AFF},
+  {0x1B000, 0x1B2FF}, {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F900, 0x1F9FF},
+  {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+int in_table(int cp, const struct interval *table, int n)
+{
+  int lo = 0;
+  int hi = n - 1;
+  int mid;
+
+  if (cp < table[0].first || cp > table[n - 1].last) return 0;
+
+  while (lo <= hi)
+  {
+    mid = (lo + hi) / 2;
+    if (cp > table[mid].last) lo = mid + 1;
+    else if (cp < table[mid].first) hi = mid - 1;
+    else return 1;
+  }
+
+  return 0;
+}
+
+/* number of columns a code point takes on the terminal */
+int cp_width(int cp)
+{
+  if (cp < 0x300) return 1;
+  if (in_table(cp, zero_width, sizeof(zero_width) / sizeof(zero_width[0]))) return 0;
+  if (in_table(cp, wide, sizeof(wide) / sizeof(wide[0]))) return 2;
+  return 1;
+}
+
+/* decodes one character, returns its length in bytes;
+   malformed sequences are consumed one byte at a time as cp = -1 */
+int utf8_char(const char *s, int len, int *cp)
+{
+  const unsigned char *u = (const unsigned char*)s;
+  int n;
+  int c;
+  int j;
+
+  if (u[0] < 0x80) { *cp = u[0]; return 1; }
+  else if (u[0] >= 0xC2 && u[0] <= 0xDF) { n = 2; c = u[0] & 0x1F; }
+  else if (u[0] >= 0xE0 && u[0] <= 0xEF) { n = 3; c = u[0] & 0x0F; }
+  else if (u[0] >= 0xF0 && u[0] <= 0xF4) { n = 4; c = u[0] & 0x07; }
+  else { *cp = -1; return 1; }
+
+  if (n > len) { *cp = -1; return 1; }
+
+  for (j = 1; j < n; j++)
+  {
+    if ((u[j] & 0xC0) != 0x80) { *cp = -1; return 1; }
+    c = (c << 6) | (u[j] & 0x3F);
+  }
+
+  if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF))
+      || (c >= 0xD800 && c <= 0xDFFF))
+  {
+    *cp = -1;
+    return 1;
+  }
+
+  *cp = c;
+  return n;
+}
+
+/* length of the leading run of ASCII bytes other than tab, all of which
+   take exactly one column */
+int ascii_run(const char *s, int len)
+{
+  int i = 0;
+
+#ifdef __SSE2__
+  const __m128i tab = _mm_set1_epi8('\t');
+  __m128i v;
+  int mask;
+
+  for (; i + 16 <= len; i += 16)
+  {
+    v = _mm_loadu_si128((const __m128i*)&s[i]);
+    mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+#endif
+
+  for (; i < len && !(s[i] & 0x80) && s[i] != '\t'; i++);
+  return i;
+}
+
+/* column reached after drawing len bytes of s starting at column col */
+int span_width(const char *s, int len, int col)
+{
+  int j = 0;
+  int run;
+  int cp;
+
+  while (j < len)
+  {
+    run = ascii_run(&s[j], len - j);
+    col += run;
+    j += run;
+    if (j == len) break;
+
+    if (s[j] == '\t')
+    {
+      col = (col / E.tabwidth + 1) * E.tabwidth;
+      j++;
+    }
+    else
+    {
+      j += utf8_char(&s[j], len - j, &cp);
+      col += cp < 0 ? 1 : cp_width(cp);
+    }
+  }
+
+  return col;
+}
+
+int str_width(str s)
+{
+  return span_width(s.chars, s.length, 0);
+}
+
+/* appends one decoded character, malformed bytes become U+FFFD */
+int put_char(buffer *buf, const char *s, int n, int cp)
+{
+  if (cp < 0) return append(buf, REPLACEMENT, 3);
+  return append(buf, (char*)s, n);
+}
+
+/* PRINT 
+  ____________
+*/
+
+static const char digits[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+int itoa(buffer *buf, int n)
+{
+  char res[12];
+  int length = 0;
+  int i = sizeof(res);
+
+  while (n >= 100)
+  {
+    i -= 2;
+    memcpy(&res[i], &digits[(n % 100) * 2], 2);
+    n /= 100;
+  }
+  if (n >= 10)
+  {
+    i -= 2;
+    memcpy(&res[i], &digits[n * 2], 2);
+  }
+  else
+    res[--i] = n + '0';
+
+  length = sizeof(res) - i;
+
+  fill(buf, ' ', E.blank - 1 - length);
+  append(buf, &res[i], length);
+  append(buf, " ", 1);
+  return 0;
+}
+
+/* columns taken by the line counter: the widest number, a space and
+   at least room for the "-> " continuation mark */
+int gutter_width(int last)
+{
+  int width = 2;
+
+  while (last >= 10)
+  {
+    width++;
+    last /= 10;
+  }
+
+  return width < 5 ? 5 : width;
+}
+
+/* appends columns [offset, offset + width) of current with tabs expanded,
+   returns the full display width of the line */
+ssize_t line_insert_tabs(buffer *buf, str current, int offset, int width)
+{
+  int col = 0;
+  int j = 0;
+  int run;
+  int from;
+  int to;
+  int n;
+  int w;
+  int cp;
+  int end = offset + width;
+
+  while (j < current.length)
+  {
+    run = ascii_run(&current.chars[j], current.length - j);
+    if (run > 0)
+    {
+      from = col > offset ? col : offset;
+      to = col + run < end ? col + run : end;
+      if (from < to)
+        append(buf, &current.chars[j + from - col], to - from);
+
+      col += run;
+      j += run;
+    }
+    else if (current.chars[j] == '\t')
+    {
+      do
+      {
+        if (col >= offset && col < end) append(buf, " ", 1);
+        col++;
+      } while (col % E.tabwidth != 0);
+      j++;
+    }
+    else
+    {
+      n = utf8_char(&current.chars[j], current.length - j, &cp);
+      w = cp < 0 ? 1 : cp_width(cp);
+
+      if (w == 0)
+      {
+        if (col > offset && col <= end) put_char(buf, &current.chars[j], n, cp);
+      }
+      else if (col >= offset && col + w <= end)
+        put_char(buf, &current.chars[j], n, cp);
+      else if (col < end && col + w > offset)
+      {
+        /* wide character cut by the edge of the screen */
+        from = col > offset ? col : offset;
+        to = col + w < end ? col + w : end;
+        fill(buf, ' ', to - from);
+      }
+
+      col += w;
+      j += n;
+    }
+  }
+
+  return col;
+}
+
+struct pagesInfo
+{
+  int index;
+  int offset;
+  int x;
+  int pindex;
+  int of;
+  int bound;
+  int max;
+};
+
+int frame_fit(buffer *out)
+{
+  /* gutter and text never exceed E.width columns of up to 4 bytes each,
+     plus "\x1b[K\n" per row */
+  int need = E.height * (4 * E.width + 4) + 3;
+
+  if (need <= out->mem) return 0;
+  return reserve(out, need);
+}
+
+/* lays out the page starting at I into out without touching the terminal,
+   returns 0 when there is nothing left to show */
+int render(struct pagesInfo *I, struct text *txt, buffer *out)
+{
+  int width;
+  int col;
+  int vcol;
+  int run;
+  int room;
+  int n;
+  int w;
+  int cp;
+  str line;
+
+  int j;
+  int rows = 0;
+  long allocs = buf_allocs;
+
+  width = (E.numbers || E.wrap) ? E.width - E.blank : E.width;
+  I->max = 0;
+
+  if (frame_fit(out) == MEM_ERROR) return MEM_ERROR;
+  out->len = 0;
+
+  if (I->of)
+  {
+    I->index = I->pindex;
+  }
+  
+
+  if (I->index != 0 || I->of == 1) append(out, "\x1b[H", 3); //move to 1,1
+  I->pindex = I->index;
+  I->of = 0;
+
+  while (rows < E.height)
+  {
+    if (I->index == I->bound) 
+    {
+      if (rows == 0) return 0;
+      while (rows++ < E.height)
+      {
+        append(out, "\x1b[K\n", 4);
+      }
+      break;
+    }
+
+    line = *line_at(txt, I->index);
+
+    if (I->x != 0)
+    {
+      fill(out, ' ', E.blank - 3);
+      append(out, "-> ", 3);
+    }
+    else if (E.numbers) itoa(out, I->index + 1);
+    else if (E.wrap) fill(out, ' ', E.blank);
+
+
+    if (!E.wrap)
+    {
+      w = line_insert_tabs(out, line, I->offset, width);
+      if (I->max < w) I->max = w;
+    }
+    else
+    {
+      j = 0;
+      col = 0;
+      vcol = 0;
+
+      if (I->x > 0)
+      {
+        j = I->x;
+        vcol = span_width(line.chars, j, 0);
+        I->x = 0;
+      }
+
+      while (j < line.length)
+      {
+        if (col == width)
+        {
+          rows++;
+          if (rows == E.height)
+          {
+            I->x = j;
+            I->index--;
+            break;
+          }
+
+          append(out, "\n", 1);
+          fill(out, ' ', E.blank - 3);
+          append(out, "-> ", 3);
+          col = 0;
+        }
+        else if ((run = ascii_run(&line.chars[j], line.length - j)) > 0)
+        {
+          room = width - col;
+          if (run > room) run = room;
+
+          append(out, &line.chars[j], run);
+          j += run;
+          col += run;
+          vcol += run;
+        }
+        else if (line.chars[j] == '\t')
+        {
+          do 
+          {
+            append(out, " ", 1);
+            col++;
+            vcol++;
+          } while (vcol % E.tabwidth != 0 && col < width);
+          j++;
+        }
+        else
+        {
+          n = utf8_char(&line.chars[j], line.length - j, &cp);
+          w = cp < 0 ? 1 : cp_width(cp);
+
+          if (col + w > width && col > 0)
+          {
+            /* wide character does not fit, move it to the next row */
+            fill(out, ' ', width - col);
+            col = width;
+            continue;
+          }
+
+          put_char(out, &line.chars[j], n, cp);
+          j += n;
+          col += w;
+          vcol += w;
+        } 
+      }
+    }
+
+    append(out, "\x1b[K\n", 4);
+    I->index++;
+    rows++;
+  }
+
+  R.frames++;
+  R.allocs += buf_allocs - allocs;
+  return 1;
+}
+
+int page(struct pagesInfo *I, struct text *txt)
+{
+  int printed = render(I, txt, &frame);
+
+  if (printed == 1)
+    write(STDIN_FILENO, frame.chars, frame.len);
+  return printed;
+}
+
+/* PREFETCH
+  _________
+*/
+
+/* while the user reads a page the helper thread lays out the next and the
+   previous one, so a keypress only has to write a finished frame. The main
+   thread waits for the helper to go idle before it touches T, E or I. A job
+   carries the document it was queued from, whose E the layout follows */
+
+#define PF_NEXT 0
+#define PF_PREV 1
+
+#define PF_EMPTY 0
+#define PF_QUEUED 1
+#define PF_READY 2
+
+struct pjob
+{
+  struct document *doc;
+  struct pagesInfo in;
+  struct pagesInfo out;
+  buffer frame;
+  int result;
+  int state;
+};
+
+struct prefetcher
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int started;
+  int busy;
+  struct text *txt;
+  struct pjob job[2];
+} P = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* page starts seen since print was called, for going back */
+struct history
+{
+  struct pagesInfo *pages;
+  int num;
+  int mem;
+} H;
+
+void *prefetch_loop(void *arg)
+{
+  struct pjob *job;
+  int j;
+
+  pthread_mutex_lock(&P.lock);
+  while (1)
+  {
+    job = NULL;
+    for (j = 0; j < 2; j++)
+      if (P.job[j].state == PF_QUEUED)
+      {
+        job = &P.job[j];
+        break;
+      }
+
+    if (job == NULL)
+    {
+      P.busy = 0;
+      pthread_cond_broadcast(&P.cond);
+      pthread_cond_wait(&P.cond, &P.lock);
+      continue;
+    }
+
+    P.busy = 1;
+    pthread_mutex_unlock(&P.lock);
+
+    D = job->doc;
+    job->out = job->in;
+    job->result = render(&job->out, P.txt, &job->frame);
+
+    pthread_mutex_lock(&P.lock);
+    job->state = PF_READY;
+  }
+
+  return arg;
+}
+
+struct helper
+{
+  void *(*fn)(void*);
+  void *arg;
+  struct document *doc;
+};
+
+void *helper_start(void *arg)
+{
+  struct helper h = *(struct helper*)arg;
+
+  free(arg);
+  D = h.doc;
+  return h.fn(h.arg);
+}
+
+/* runs fn(arg) on a new thread working on the caller's document */
+int spawn_helper(pthread_t *thread, void *(*fn)(void*), void *arg)
+{
+  struct helper *h = (struct helper*)malloc(sizeof(struct helper));
+  sigset_t all;
+  sigset_t old;
+  int res;
+
+  if (h == NULL) return MEM_ERROR;
+  h->fn = fn;
+  h->arg = arg;
+  h->doc = D;
+
+  /* signals (SIGWINCH) stay with the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  res = pthread_create(thread, NULL, helper_start, h);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (res != 0) free(h);
+  return res;
+}
+
+void prefetch_wait()
+{
+  if (!P.started) return;
+
+  pthread_mutex_lock(&P.lock);
+  while (P.busy || P.job[PF_NEXT].state == PF_QUEUED || P.job[PF_PREV].state == PF_QUEUED)
+    pthread_cond_wait(&P.cond, &P.lock);
+  pthread_mutex_unlock(&P.lock);
+}
+
+void prefetch_drop()
+{
+  prefetch_wait();
+  P.job[PF_NEXT].state = PF_EMPTY;
+  P.job[PF_PREV].state = PF_EMPTY;
+}
+
+/* queues the pages around I, the caller must have waited for the helper */
+void prefetch(struct pagesInfo *I, struct text *txt)
+{
+  struct pagesInfo prev;
+
+  if (!P.started)
+  {
+    if (spawn_helper(&P.thread, prefetch_loop, NULL) != 0) return;
+    P.started = 1;
+  }
+
+  pthread_mutex_lock(&P.lock);
+  P.txt = txt;
+
+  P.job[PF_NEXT].doc = D;
+  P.job[PF_NEXT].in = *I;
+  P.job[PF_NEXT].state = PF_QUEUED;
+
+  P.job[PF_PREV].state = PF_EMPTY;
+  if (H.num > 1)
+  {
+    prev = H.pages[H.num - 2];
+    prev.offset = I->offset;
+    prev.pindex = prev.index;
+    prev.of = 1;
+    P.job[PF_PREV].doc = D;
+    P.job[PF_PREV].in = prev;
+    P.job[PF_PREV].state = PF_QUEUED;
+  }
+
+  pthread_cond_broadcast(&P.cond);
+  pthread_mutex_unlock(&P.lock);
+}
+
+int same_page(struct pagesInfo *a, struct pagesInfo *b)
+{
+  return a->index == b->index && a->x == b->x && a->offset == b->offset
+      && a->of == b->of && a->bound == b->bound && (!a->of || a->pindex == b->pindex);
+}
+
+/* shows a prefetched frame if it was laid out from state I, returns what
+   render gave or -1 when the page still has to be rendered */
+int prefetch_take(int which, struct pagesInfo *I)
+{
+  struct pjob *job = &P.job[which];
+
+  if (job->state != PF_READY || job->doc != D || !same_page(&job->in, I)) return -1;
+
+  job->state = PF_EMPTY;
+  if (job->result == 1)
+    write(STDIN_FILENO, job->frame.chars, job->frame.len);
+  *I = job->out;
+
+  return job->result;
+}
+
+int history_push(struct pagesInfo *start)
+{
+  struct pagesInfo *tmp = NULL;
+
+  if (H.num == H.mem)
+  {
+    tmp = (struct pagesInfo*)realloc(H.pages, (H.mem + BUFFADD) * sizeof(struct pagesInfo));
+    if (tmp == NULL) return MEM_ERROR;
+
+    H.pages = tmp;
+    H.mem += BUFFADD;
+  }
+
+  H.pages[H.num++] = *start;
+  return 0;
+}
+
+
+
+/* while the file loads, the pages reach as far as it has come: the lines
+   the page after I needs are waited for before it is laid out */
+void page_load(struct pagesInfo *I, struct text *txt, int end)
+{
+  int bound;
+  int k;
+
+  if (txt != &T || !L.active) return;
+
+  load_until(I->index + E.height);
+  bound = end > T.num ? T.num : end;
+  if (bound == I->bound) return;
+
+  I->bound = bound;
+  for (k = 0; k < H.num; k++)
+    H.pages[k].bound = bound;
+  E.blank = gutter_width(bound);
+}
+
+int print(int start, int end, struct text *txt) 
+{
+  char c;
+  int printed;
+  int j;
+  struct pagesInfo from;
+
+  if (!E.tty)
+    return dump(start, end, txt);
+
+  I.index = start < 1 ? 0 : start - 1;
+  I.offset = 0;
+  I.x = 0;
+  I.pindex = 0;
+  I.of = 0;
+  I.bound = end > txt->num ? txt->num : end;
+  I.max = 0;
+
+  if (winch)
+  {
+    winch = 0;
+    get_window_size();
+  }
+  E.blank = gutter_width(I.bound);
+
+  H.num = 0;
+  history_push(&I);
+  page(&I, txt);
+
+  E.printing = 1;
+  page_load(&I, txt, end);
+  prefetch(&I, txt);
+
+  while (1) 
+  {
+    enable_raw_mode();
+    read(STDIN_FILENO, &c, 1);
+    disable_raw_mode();
+
+    prefetch_wait();
+
+    /* a page turn counts as a command: what the pages left behind hold
+       is cold now and may go out */
+    atomic_fetch_add(&K.tick, 1);
+    squeeze(&T);
+
+    if (winch)
+    {
+      winch = 0;
+      get_window_size();
+      prefetch_drop();
+      I.of = 1;
+      page(&I, txt);
+    }
+
+    if (c == ' ')
+    {
+      from = I;
+      printed = prefetch_take(PF_NEXT, &I);
+      if (printed == -1)
+        printed = page(&I, txt);
+      if (printed == MEM_ERROR) return MEM_ERROR;
+      if (printed == 0) 
+      {
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        for (j = 0; j < E.height; j++)
+          write(STDOUT_FILENO, "\x1b[K\n", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        break;
+      }
+      history_push(&from);
+      if (I.offset > 0 && I.max - E.width + E.blank + 1 < I.offset)
+      {
+        I.offset = I.max - E.width + E.blank + 1;
+        if (I.offset < 0) I.offset = 0;
+        I.of = 1;
+        page(&I, txt);
+      }
+
+    }
+    else if (c == 'b' && H.num > 1)
+    {
+      H.num--;
+      from = H.pages[H.num - 1];
+      from.offset = I.offset;
+      from.pindex = from.index;
+      from.of = 1;
+
+      I = from;
+      if (prefetch_take(PF_PREV, &I) == -1)
+        page(&I, txt);
+    }
+    else if (c == 'q')
+    {
+      write(STDOUT_FILENO, "\x1b[H", 3);
+      for (j = 0; j < E.height; j++)
+        write(STDOUT_FILENO, "\x1b[K\n", 4);
+      write(STDOUT_FILENO, "\x1b[H", 3);
+      break;
+    }
+    else if (c == '>' && E.wrap == 0 && I.max - E.width + E.blank >= I.offset)
+    {
+      I.offset++;
+      I.of = 1;
+      page(&I, txt);
+    }
+    else if (c == '<' && E.wrap == 0 && I.offset > 0)
+    {
+      I.offset--;
+      I.of = 1;
+      page(&I, txt);
+    }
+    else
+    {
+      c = 0;
+      continue;
+    }
+
+    page_load(&I, txt, end);
+    prefetch(&I, txt);
+    c = 0;
+  }
+
+  prefetch_drop();
+  E.printing = 0;
+  return 0;
+}
+
+/* the last page of the text: as many lines back from its end as fit */
+void tail_page()
+{
+  int width;
+  int rows = 0;
+  int h;
+
+  E.blank = gutter_width(T.num);
+  width = (E.numbers || E.wrap) ? E.width - E.blank : E.width;
+
+  I.index = T.num;
+  while (I.index > 0)
+  {
+    h = E.wrap ? (str_width(*line_at(&T, I.index - 1)) + width - 1) / width : 1;
+    if (h < 1) h = 1;
+    if (rows + h > E.height && rows > 0) break;
+    rows += h;
+    I.index--;
+  }
+
+  I.offset = 0;
+  I.x = 0;
+  I.pindex = I.index;
+  I.of = 1;
+  I.bound = T.num;
+  I.max = 0;
+  page(&I, &T);
+}
+
+/* print follow: the end of the text, kept in view while the file grows.
+   Without a terminal the lines are printed as they are completed. q, or
+   the end of the input, leaves */
+int print_follow()
+{
+  struct pollfd fds[2];
+  int was = O.active;
+  long reread;
+  int shown;
+  int res = 0;
+  int n;
+  char c = 0;
+
+  if (out != NULL)
+  {
+    msg("print follow needs the editor's own output\n");
+    return -1;
+  }
+  if (follow_start() != 0) return -1;
+
+  /* the last line is open until a newline ends it */
+  shown = T.num - 1 > E.height ? T.num - 1 - E.height : 0;
+  if (E.tty)
+  {
+    if (winch)
+    {
+      winch = 0;
+      get_window_size();
+    }
+    E.printing = 1;
+    tail_page();
+    enable_raw_mode();
+  }
+  else
+  {
+    dump(shown + 1, T.num - 1, &T);
+    fflush(stdout);
+    shown = T.num - 1;
+  }
+
+  while (1)
+  {
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = O.watch;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+    {
+      res = -1;
+      break;
+    }
+
+    if (E.tty && winch)
+    {
+      winch = 0;
+      get_window_size();
+      tail_page();
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      reread = O.reread;
+      if (follow_take(0) < 0)
+      {
+        res = -1;
+        break;
+      }
+      atomic_fetch_add(&K.tick, 1);
+      squeeze(&T);
+
+      if (E.tty)
+        tail_page();
+      else
+      {
+        if (O.reread != reread) shown = 0;
+        if (shown < T.num - 1)
+        {
+          dump(shown + 1, T.num - 1, &T);
+          fflush(stdout);
+          shown = T.num - 1;
+        }
+      }
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP))
+    {
+      n = read(STDIN_FILENO, &c, 1);
+      if ((n <= 0 && !E.tty) || c == 'q') break;
+    }
+  }
+
+  if (E.tty)
+  {
+    disable_raw_mode();
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    for (n = 0; n < E.height; n++)
+      write(STDOUT_FILENO, "\x1b[K\n", 4);
+    write(STDOUT_FILENO, "\x1b[H", 3);
+    E.printing = 0;
+  }
+  if (!was) follow_stop();
+  return res;
+}
+
+/* print without a terminal: lines as they are, numbered if numbers are on */
+int dump(int start, int end, struct text *txt)
+{
+  buffer buf = NEWBUF;
+  int j;
+
+  start = start < 1 ? 0 : start - 1;
+  end = end > txt->num ? txt->num : end;
+  E.blank = gutter_width(end);
+
+  for (j = start; j < end; j++)
+  {
+    if (E.numbers) itoa(&buf, j + 1);
+    if (append(&buf, line_at(txt, j)->chars, line_at(txt, j)->length) == MEM_ERROR
+        || append(&buf, "\n", 1) == MEM_ERROR)
+    {
+      free(buf.chars);
+      return MEM_ERROR;
+    }
+
+    if (buf.len >= BUFSIZ || j == end - 1)
+    {
+      fwrite(buf.chars, sizeof(char), buf.len, output());
+      buf.len = 0;
+    }
+
+    /* a long print keeps T in its budget as it goes */
+    if (txt == &T && (j + 1) % CHUNK == 0)
+      squeeze_grown(&T);
+  }
+
+  free(buf.chars);
+  return 0;
+}
+
+void sighandler(int sig)
+{
+  sig+=0;
+  /* picked up by print, the helper thread may be reading E right now */
+  winch = 1;
+}
+
+
+/*  COMMANDS
+   _________
+ */
+int tokenizer_init(struct tokenizer *tk, int fd)
+{
+  tk->in.fd = fd;
+  tk->in.pos = 0;
+  tk->in.len = 0;
+  tk->in.eof = 0;
+  tk->in.mem = BLOCK;
+  tk->in.buf = (char*)malloc(BLOCK);
+  if (tk->in.buf == NULL) return MEM_ERROR;
+
+  resetbuf(&tk->chars);
+  tk->tokens = NULL;
+  tk->offs = NULL;
+  tk->num = 0;
+  tk->mem = 0;
+  tk->lines = 0;
+  tk->more = 0;
+
+  return 0;
+}
+
+void tokenizer_free(struct tokenizer *tk)
+{
+  free(tk->in.buf);
+  free(tk->chars.chars);
+  free(tk->tokens);
+  free(tk->offs);
+}
+
+void tokens_reset(struct tokenizer *tk)
+{
+  tk->num = 0;
+  tk->chars.len = 0;
+}
+
+/* points the tokens from first on into the arena, which may have moved */
+void tokens_bind(struct tokenizer *tk, int first)
+{
+  int k;
+
+  for (k = first; k < tk->num; k++)
+    tk->tokens[k].chars = tk->chars.chars + tk->offs[k];
+}
+
+/* gets the next line without its newline; returns 1 if it ended with a
+   newline, 0 if it ended at the end of input and EOF when nothing is left */
+int reader_line(struct reader *r, str *line)
+{
+  char *nl;
+  char *tmp;
+  ssize_t n;
+
+  while (1)
+  {
+    nl = (char*)memchr(r->buf + r->pos, '\n', r->len - r->pos);
+    if (nl != NULL)
+    {
+      line->chars = r->buf + r->pos;
+      line->length = nl - line->chars;
+      r->pos += line->length + 1;
+      return 1;
+    }
+
+    if (r->eof)
+    {
+      if (r->pos == r->len) return EOF;
+
+      line->chars = r->buf + r->pos;
+      line->length = r->len - r->pos;
+      r->pos = r->len;
+      return 0;
+    }
+
+    /* keep the unfinished line and fill the rest of the block */
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+
+    if (r->len == r->mem)
+    {
+      tmp = (char*)realloc(r->buf, r->mem * 2);
+      if (tmp == NULL) return EOF;
+      r->buf = tmp;
+      r->mem *= 2;
+    }
+
+    n = read(r->fd, r->buf + r->len, r->mem - r->len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0)
+      r->eof = 1;
+    else
+      r->len += n;
+  }
+}
+
+int tokens_grow(struct tokenizer *tk)
+{
+  str *tmp = NULL;
+  int *otmp = NULL;
+
+  tmp = (str*)realloc(tk->tokens, (tk->mem + BUFFADD) * sizeof(str));
+  if (tmp == NULL) return MEM_ERROR;
+  tk->tokens = tmp;
+
+  otmp = (int*)realloc(tk->offs, (tk->mem + BUFFADD) * sizeof(int));
+  if (otmp == NULL) return MEM_ERROR;
+  tk->offs = otmp;
+
+  tk->mem += BUFFADD;
+  return 0;
+}
+
+int add_token(struct tokenizer *tk)
+{
+  if (append(&tk->chars, "\0", 1) == MEM_ERROR) return MEM_ERROR;
+  if (tk->num + 1 >= tk->mem && tokens_grow(tk) == MEM_ERROR) return MEM_ERROR;
+
+  tk->tokens[tk->num].length = tk->chars.len - 1 - tk->offs[tk->num];
+  tk->num++;
+  tk->offs[tk->num] = tk->chars.len;
+
+  return 0;
+}
+
+void escape(buffer *buf, char c)
+{
+  if (c == 'n')
+    append(buf, "\n" , 1);
+  else if (c == 't')
+    append(buf, "\t", 1);
+  else if (c == 'r')
+    append(buf, "\r", 1);
+  else
+    append(buf, &c, 1);
+}
+
+/* reads one command into ar, returns 0 when a command was read, 1 on a
+   quoting error and EOF at the end of input. If tk->more is set, input
+   that ends inside triple quotes returns 2 and reads nothing. The tokens
+   are added to the arena of tk and ar stays valid until the arena is
+   reset or grows */
+int read_command(struct tokenizer *tk, struct arraystr *ar)
+{
+  str line;
+  int nl;
+  int j;
+  int run;
+  int cont;
+  int first = tk->num;
+  int par = 0;
+  int parn = 0;
+  int trpar = 0;
+  char c;
+
+  ar->lines = NULL;
+  ar->num = 0;
+
+  if (tk->num >= tk->mem && tokens_grow(tk) == MEM_ERROR) return MEM_ERROR;
+  tk->offs[first] = tk->chars.len;
+
+  while (1)
+  {
+    nl = reader_line(&tk->in, &line);
+
+    if (nl == EOF)
+    {
+      if (par && trpar && tk->more)
+      {
+        tk->num = first;
+        tk->chars.len = tk->offs[first];
+        return 2;
+      }
+      if (par)
+      {
+        msg("wrong input: parenthases\n");
+        goto error;
+      }
+      if (tk->chars.len > tk->offs[tk->num] || parn == 2) add_token(tk);
+      if (tk->num == first) return EOF;
+      break;
+    }
+
+    cont = 0;
+    for (j = 0; j < line.length; j++)
+    {
+      c = line.chars[j];
+
+      if (c == '\\')
+      {
+        if (j + 1 < line.length)
+          escape(&tk->chars, line.chars[++j]);
+        else if (nl)
+        {
+          /* an escaped newline is kept and the command goes on */
+          append(&tk->chars, "\n", 1);
+          cont = 1;
+        }
+
+        parn = 0;
+      }
+      else if (!par && (c == ' ' || c == '\t'))
+      {
+        if (tk->chars.len > tk->offs[tk->num] || parn == 2) add_token(tk);
+      }
+      else if (c == '\"')
+      {
+        par = par == 0 ? 1 : 0;
+        parn++;
+        if (parn == 3)
+        {
+          trpar = trpar == 0 ? 1 : 0;
+          parn = 0;
+        }
+      }
+      else if (!par && c == '#')
+      {
+        /* the rest of the line is a comment */
+        if (tk->chars.len > tk->offs[tk->num] || parn == 2) add_token(tk);
+        if (nl) tk->lines++;
+        goto done;
+      }
+      else
+      {
+        for (run = j + 1; run < line.length; run++)
+        {
+          c = line.chars[run];
+          if (c == '\\' || c == '\"' || (!par && (c == ' ' || c == '\t' || c == '#')))
+            break;
+        }
+
+        append(&tk->chars, &line.chars[j], run - j);
+        j = run - 1;
+        parn = 0;
+      }
+    }
+
+    if (!nl) continue;
+    tk->lines++;
+    if (cont) continue;
+
+    if (!par)
+    {
+      if (tk->chars.len > tk->offs[tk->num] || parn == 2) add_token(tk);
+      break;
+    }
+    else if (!trpar)
+    {
+      msg("wrong input: parenthases\n");
+      goto error;
+    }
+    else
+      append(&tk->chars, "\n", 1);
+  }
+
+done:
+  tokens_bind(tk, first);
+  ar->lines = tk->tokens + first;
+  ar->num = tk->num - first;
+  return 0;
+
+error:
+  tk->num = first;
+  tk->chars.len = tk->offs[first];
+  return 1;
+}
+
+
+/* SCRIPTS
+  ________
+*/
+
+struct command
+{
+  struct arraystr tokens;
+  int first;
+  int line;
+};
+
+/* editor -s script [file]: parses the whole script first, then runs it
+   against file without touching the terminal. Exits with 0 when every
+   command succeeded, 1 when one failed and 2 when the script or the file
+   could not be read */
+int run_script(char *name, char *filename)
+{
+  int fd;
+  struct tokenizer tk;
+  struct command *cmds = NULL;
+  struct command *tmp = NULL;
+  struct arraystr ar;
+  int num = 0;
+  int mem = 0;
+  int bad = 0;
+  int failed = 0;
+  int res = 0;
+  int j;
+
+  fd = strcmp(name, "-") ? open(name, O_RDONLY) : STDIN_FILENO;
+  if (fd == -1)
+  {
+    fprintf(stderr, "%s: failed to open script\n", name);
+    return 2;
+  }
+  if (tokenizer_init(&tk, fd) == MEM_ERROR)
+    return 2;
+
+  /* every command stays in the arena until the script is done */
+  S.name = name;
+  while (1)
+  {
+    S.line = tk.lines + 1;
+    res = read_command(&tk, &ar);
+    if (res == EOF) break;
+    if (res != 0)
+    {
+      bad = 1;
+      continue;
+    }
+    if (ar.num == 0) continue;
+
+    if (num == mem)
+    {
+      tmp = (struct command*)realloc(cmds, (mem + BUFFADD) * sizeof(struct command));
+      if (tmp == NULL)
       {
-        append(&buf, "\n", 1);
+        bad = 1;
+        break;
       }
+      cmds = tmp;
+      mem += BUFFADD;
+    }
+
+    cmds[num].first = tk.num - ar.num;
+    cmds[num].tokens.num = ar.num;
+    cmds[num++].line = S.line;
+  }
+
+  if (fd != STDIN_FILENO) close(fd);
+
+  tokens_bind(&tk, 0);
+  for (j = 0; j < num; j++)
+    cmds[j].tokens.lines = tk.tokens + cmds[j].first;
+
+  if (!bad && filename != NULL)
+  {
+    S.name = filename;
+    S.line = 0;
+    bad = e_open(filename) != 0;
+    S.name = name;
+  }
+
+  for (j = 0; j < num && !bad; j++)
+  {
+    S.line = cmds[j].line;
+    S.reported = 0;
+
+    res = execute(&cmds[j].tokens);
+    if (res == COM_EXIT)
+      break;
+    else if (res != 0)
+    {
+      failed++;
+      if (!S.reported) msg("command failed\n");
+      if (!S.keep_going) break;
+    }
+    else if (S.verbose)
+      fprintf(stderr, "%s:%d: ok\n", S.name, S.line);
+  }
+
+  save_wait();
+  buffers_wait();
+  if (!bad && j == num && !E.saved)
+  {
+    S.line = 0;
+    msg("progress wasn`t saved\n");
+    failed++;
+  }
+  else if (!bad && j == num && buffers_unsaved() >= 0)
+  {
+    S.line = 0;
+    msg("buffer %d wasn`t saved\n", buffers_unsaved() + 1);
+    failed++;
+  }
+
+  tokenizer_free(&tk);
+  free(cmds);
+  fflush(stdout);
+
+  if (bad) return 2;
+  return failed ? 1 : 0;
+}
+
+
+/* BUFFERS
+  ________
+*/
+
+/* every buffer is a document of its own with its own dirty state; they
+   share the heap and the retired storage list, so switching reads
+   nothing and copying between buffers touches no file */
+
+/* a new empty document, hosted as key unless key is NULL */
+struct document *doc_new(char *key)
+{
+  struct document *d = (struct document*)calloc(1, sizeof(struct document));
+  struct document *prev = D;
+
+  if (d == NULL) return NULL;
+  if (key != NULL && (d->key = strdup(key)) == NULL)
+  {
+    free(d);
+    return NULL;
+  }
+
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_mutex_init(&d->saver.lock, NULL);
+  pthread_mutex_init(&d->loader.lock, NULL);
+  pthread_cond_init(&d->loader.cond, NULL);
+
+  D = d;
+  init_document();
+  D = prev;
+  return d;
+}
+
+void doc_free(struct document *d)
+{
+  struct document *prev = D;
+
+  D = d;
+  save_wait();
+  follow_stop();
+  if (B.active) e_rollback();
+  free(B.ins);
+  free(B.del);
+  undo_drop();
+  macro_drop();
+  free(G.chars);
+  text_release(&T);
+  free(E.filename);
+  D = prev;
+
+  pthread_mutex_destroy(&d->lock);
+  pthread_mutex_destroy(&d->saver.lock);
+  pthread_mutex_destroy(&d->loader.lock);
+  pthread_cond_destroy(&d->loader.cond);
+  free(d->key);
+  free(d);
+}
+
+int buffer_add(struct document *d)
+{
+  struct document **tmp = NULL;
+
+  if (F.num == F.mem)
+  {
+    tmp = (struct document**)realloc(F.docs, (F.mem + BUFFADD) * sizeof(struct document*));
+    if (tmp == NULL) return MEM_ERROR;
+    F.docs = tmp;
+    F.mem += BUFFADD;
+  }
+
+  F.docs[F.num++] = d;
+  return 0;
+}
+
+/* makes d current; the terminal belongs to the editor, not to a text */
+void buffer_enter(struct document *d)
+{
+  prefetch_drop();
+  d->config.width = E.width;
+  d->config.height = E.height;
+  d->config.tty = E.tty;
+  d->config.orig_termios = E.orig_termios;
+  d->config.raw = E.raw;
+  D = d;
+}
+
+int e_buffer_open(char *filename)
+{
+  struct document *prev = D;
+  struct document *d;
+  int k;
+
+  for (k = 0; k < F.num; k++)
+    if (F.docs[k]->config.filename != NULL && !strcmp(F.docs[k]->config.filename, filename))
+      return e_buffer_switch(k + 1);
+
+  d = doc_new(NULL);
+  if (d == NULL) return MEM_ERROR;
+  if (buffer_add(d) == MEM_ERROR)
+  {
+    doc_free(d);
+    return MEM_ERROR;
+  }
+
+  buffer_enter(d);
+  if (e_open(filename) != 0)
+  {
+    F.num--;
+    D = prev;
+    doc_free(d);
+    return -1;
+  }
+
+  return 0;
+}
+
+int e_buffer_switch(int n)
+{
+  if (n < 1 || n > F.num)
+  {
+    msg("no such buffer\n");
+    return -1;
+  }
+
+  buffer_enter(F.docs[n - 1]);
+  return 0;
+}
+
+void e_buffer_list()
+{
+  struct document *cur = D;
+  int k;
+
+  for (k = 0; k < F.num; k++)
+  {
+    D = F.docs[k];
+    save_collect();
+    load_take();
+    fprintf(output(), "%c%3d %s, %d lines%s%s\n", D == cur ? '*' : ' ', k + 1,
+            E.filename != NULL ? E.filename : "[no name]", T.num,
+            L.active ? " so far, loading" : "", E.saved ? "" : ", not saved");
+  }
+  D = cur;
+}
+
+/* waits for the saves running in the buffers other than the current */
+void buffers_wait()
+{
+  struct document *cur = D;
+  int k;
+
+  for (k = 0; k < F.num; k++)
+  {
+    if (F.docs[k] == cur) continue;
+
+    D = F.docs[k];
+    if (W.pending)
+    {
+      D = cur;
+      msg("waiting for the save to %s to finish\n", F.docs[k]->saver.filename);
+      D = F.docs[k];
+      save_wait();
+    }
+  }
+  D = cur;
+}
+
+/* the first buffer but the current with edits not saved, -1 if none */
+int buffers_unsaved()
+{
+  int k;
+
+  for (k = 0; k < F.num; k++)
+    if (F.docs[k] != D && !F.docs[k]->config.saved)
+      return k;
+
+  return -1;
+}
+
+/* frees every buffer but main_doc and makes that current again */
+void buffers_free()
+{
+  int k;
+
+  buffer_enter(&main_doc);
+  for (k = 0; k < F.num; k++)
+    if (F.docs[k] != &main_doc)
+      doc_free(F.docs[k]);
+
+  free(F.docs);
+  F.docs = NULL;
+  F.num = 0;
+  F.mem = 0;
+}
+
+
+/* SERVER
+  _______
+*/
+
+/* editor -l socket: hosts documents for many clients on a UNIX socket.
+   The main thread runs an epoll loop that accepts, reads and writes; a
+   connection with a complete line waiting is queued for a pool of
+   workers that run its commands. A connection starts on an empty
+   document of its own, open "F" moves it to the document hosted for F,
+   which every connection that opened F shares. A document runs one
+   command at a time, different documents run side by side. Every command
+   is answered with "ok N" or "error N" on a line, then the N bytes it
+   printed */
+
+struct client
+{
+  int fd;
+  pthread_mutex_t lock;
+  buffer in;
+  buffer reply;
+  int queued;
+  int eof;
+  int gone;
+  int held;
+  struct document *doc;
+  struct client *next;
+  struct client *before;
+  struct client *after;
+};
+
+struct server
+{
+  int fd;
+  int epfd;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct client *head;
+  struct client *tail;
+  struct client *all;
+  struct document **docs;
+  int ndocs;
+  int mdocs;
+  int stop;
+} N = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+volatile sig_atomic_t quit = 0;
+
+void stop_handler(int sig)
+{
+  sig+=0;
+  quit = 1;
+}
+
+/* lets go of d; a document nobody uses is dropped, unless it is hosted
+   and holds edits that were not saved */
+void doc_detach(struct document *d)
+{
+  struct document *prev = D;
+  int last;
+  int drop;
+  int k;
+
+  pthread_mutex_lock(&N.lock);
+  last = d->users == 1;
+  pthread_mutex_unlock(&N.lock);
+
+  /* a save still running decides whether the edits are kept */
+  if (last)
+  {
+    pthread_mutex_lock(&d->lock);
+    D = d;
+    save_wait();
+    D = prev;
+    pthread_mutex_unlock(&d->lock);
+  }
+
+  pthread_mutex_lock(&N.lock);
+  d->users--;
+  drop = d->users == 0 && (d->key == NULL || d->config.saved);
+  for (k = 0; drop && d->key != NULL && k < N.ndocs; k++)
+    if (N.docs[k] == d)
+    {
+      N.docs[k] = N.docs[--N.ndocs];
+      break;
     }
-    else if (c == '\\')
+  pthread_mutex_unlock(&N.lock);
+
+  if (drop) doc_free(d);
+}
+
+/* moves c to the document hosted for name, reading it in if nobody has */
+int server_open(struct client *c, char *name)
+{
+  struct document **tmp = NULL;
+  struct document *d = NULL;
+  int fresh = 0;
+  int k;
+
+  pthread_mutex_lock(&N.lock);
+  for (k = 0; k < N.ndocs && d == NULL; k++)
+    if (!strcmp(N.docs[k]->key, name)) d = N.docs[k];
+
+  if (d == NULL)
+  {
+    if (N.ndocs == N.mdocs)
     {
-      c = fgetc(stdin);
-      if (c == 'n')
-      {
-        append(&buf, "\n" , 1);
-      }
-      else if (c == 't')
+      tmp = (struct document**)realloc(N.docs, (N.mdocs + BUFFADD) * sizeof(struct document*));
+      if (tmp == NULL)
       {
-        append(&buf, "\t", 1);
-      }
-      else if (c == 'r')
-      {
-        append(&buf, "\r", 1);
-      }
-      else if (c == '\\') 
-      {
-        append(&buf, "\\" , 1);
-      }
-      else
-      {
-        append(&buf, &c, 1);
+        pthread_mutex_unlock(&N.lock);
+        return MEM_ERROR;
       }
+      N.docs = tmp;
+      N.mdocs += BUFFADD;
+    }
+
+    if ((d = doc_new(name)) == NULL)
+    {
+      pthread_mutex_unlock(&N.lock);
+      return MEM_ERROR;
+    }
+
+    /* held until it is read, whoever else opens it waits for that */
+    pthread_mutex_lock(&d->lock);
+    N.docs[N.ndocs++] = d;
+    fresh = 1;
+  }
+  d->users++;
+  pthread_mutex_unlock(&N.lock);
+
+  if (fresh)
+  {
+    D = d;
+    k = e_open(name);
+    pthread_mutex_unlock(&d->lock);
+    if (k != 0)
+    {
+      doc_detach(d);
+      return -1;
+    }
+  }
+
+  doc_detach(c->doc);
+  c->doc = d;
+  return 0;
+}
+
+/* runs one command of c on its document */
+int client_execute(struct client *c, struct arraystr *ar)
+{
+  int res;
+
+  if (!strcmp(ar->lines[0].chars, "buffer")
+      || (ar->num > 1 && !strcmp(ar->lines[0].chars, "insert") && !strcmp(ar->lines[1].chars, "buffer")))
+  {
+    msg("buffers are not available on a connection, use open\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&c->doc->lock);
+  D = c->doc;
+  if (ar->num == 2 && !strcmp(ar->lines[0].chars, "open") && !B.active)
+  {
+    pthread_mutex_unlock(&c->doc->lock);
+    return server_open(c, ar->lines[1].chars);
+  }
+
+  res = execute(ar);
+  pthread_mutex_unlock(&c->doc->lock);
+  return res;
+}
+
+/* the first held bytes of c->in are a command whose quotes are still
+   open, it waits for a newline after them or for the end of input */
+int has_line(struct client *c)
+{
+  return (c->in.len > c->held && memchr(c->in.chars + c->held, '\n', c->in.len - c->held) != NULL)
+      || (c->eof && c->held > 0);
+}
+
+/* puts c on the work queue, c->lock held */
+void enqueue(struct client *c)
+{
+  c->queued = 1;
+  c->next = NULL;
+
+  pthread_mutex_lock(&N.lock);
+  if (N.tail != NULL)
+    N.tail->next = c;
+  else
+    N.head = c;
+  N.tail = c;
+  pthread_cond_signal(&N.cond);
+  pthread_mutex_unlock(&N.lock);
+}
+
+/* asks the loop for what c waits for now, c->lock held. Connections are
+   armed one shot, so a queued one stays quiet until its worker is done */
+void client_arm(struct client *c, int events)
+{
+  struct epoll_event ev;
+
+  if (!c->eof && !c->gone) events |= EPOLLIN;
+  if (c->reply.len > 0) events |= EPOLLOUT;
+  if (events == 0) return;
+
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = c;
+  epoll_ctl(N.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* puts the start of a command back in front of what c sent since */
+void client_hold(struct client *c, char *chars, int len)
+{
+  pthread_mutex_lock(&c->lock);
+  if (reserve(&c->in, c->in.len + len) == MEM_ERROR)
+    c->gone = 1;
+  else
+  {
+    memmove(c->in.chars + len, c->in.chars, c->in.len);
+    memcpy(c->in.chars, chars, len);
+    c->in.len += len;
+    c->held = len;
+  }
+  pthread_mutex_unlock(&c->lock);
+}
 
-      parn = 0;
+/* runs the complete lines c has sent, one command at a time, and leaves
+   the replies for the loop to write */
+void serve(struct client *c, struct tokenizer *tk)
+{
+  struct arraystr ar;
+  char head[32];
+  char *text;
+  char *end = NULL;
+  char *tmp = NULL;
+  size_t size;
+  int gone = 0;
+  int n = 0;
+  int start;
+  int res;
+
+  pthread_mutex_lock(&c->lock);
+  tk->more = !c->eof;
+  c->held = 0;
+  if (!c->gone && c->in.len > 0)
+    end = (char*)memrchr(c->in.chars, '\n', c->in.len);
+  if (end != NULL)
+  {
+    n = end - c->in.chars + 1;
+    if (n > tk->in.mem && (tmp = (char*)realloc(tk->in.buf, n)) != NULL)
+    {
+      tk->in.buf = tmp;
+      tk->in.mem = n;
     }
-    else if (!par && (c == ' ' || c == '\t'))
-    { 
-      if (buf.len > 0 || parn == 2) add_token(ar, &buf);
+
+    if (n <= tk->in.mem)
+    {
+      memcpy(tk->in.buf, c->in.chars, n);
+      memmove(c->in.chars, c->in.chars + n, c->in.len - n);
+      c->in.len -= n;
     }
-    else if (c == '\"') 
+    else
     {
-      par = par == 0 ? 1 : 0;
-      parn++;
-      if (parn == 3)
-      {
-        trpar = trpar == 0 ? 1 : 0;
-        parn = 0;
-      }
+      c->gone = 1;
+      n = 0;
     }
-    else if (!par && c == '#')
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  tk->in.pos = 0;
+  tk->in.len = n;
+  tk->in.eof = 1;
+
+  while (n > 0 && !gone)
+  {
+    tokens_reset(tk);
+    text = NULL;
+    size = 0;
+    if ((out = open_memstream(&text, &size)) == NULL) break;
+
+    start = tk->in.pos;
+    res = read_command(tk, &ar);
+    if (res == EOF || res == 2)
     {
-      add_token(ar, &buf);
+      fclose(out);
+      out = NULL;
+      free(text);
+      if (res == 2) client_hold(c, tk->in.buf + start, n - start);
       break;
     }
+    if (res == 0 && ar.num > 0)
+      res = client_execute(c, &ar);
+    else if (res != 0)
+      /* a quoting error, not to be taken for COM_EXIT */
+      res = -1;
+
+    fclose(out);
+    out = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    if (res != 0 || ar.num > 0 || size > 0)
+    {
+      snprintf(head, sizeof(head), "%s %zu\n", res == 0 || res == COM_EXIT ? "ok" : "error", size);
+      if (append(&c->reply, head, strlen(head)) == MEM_ERROR
+          || append(&c->reply, text, size) == MEM_ERROR)
+        c->gone = 1;
+    }
+    if (res == COM_EXIT) c->gone = 1;
+    gone = c->gone;
+    pthread_mutex_unlock(&c->lock);
+
+    free(text);
+  }
+
+  /* nothing more will come: the document is let go here, the loop frees
+     the connection once the replies are out */
+  pthread_mutex_lock(&c->lock);
+  gone = c->gone || (c->eof && !has_line(c));
+  pthread_mutex_unlock(&c->lock);
+
+  if (gone && c->doc != NULL)
+  {
+    doc_detach(c->doc);
+    c->doc = NULL;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  if (!c->gone && has_line(c))
+    enqueue(c);
+  else
+    c->queued = 0;
+  client_arm(c, EPOLLOUT);
+  pthread_mutex_unlock(&c->lock);
+}
+
+void *server_loop(void *arg)
+{
+  struct tokenizer tk;
+  struct client *c;
+
+  if (tokenizer_init(&tk, -1) == MEM_ERROR) return arg;
+
+  while (1)
+  {
+    pthread_mutex_lock(&N.lock);
+    while (N.head == NULL && !N.stop)
+      pthread_cond_wait(&N.cond, &N.lock);
+
+    c = N.head;
+    if (c != NULL)
+    {
+      N.head = c->next;
+      if (N.head == NULL) N.tail = NULL;
+    }
+    pthread_mutex_unlock(&N.lock);
+
+    if (c == NULL) break;
+    serve(c, &tk);
+  }
+
+  tokenizer_free(&tk);
+  return arg;
+}
+
+/* reads what c sent, c->lock held */
+void client_read(struct client *c)
+{
+  ssize_t n;
+
+  while (!c->eof)
+  {
+    if (reserve(&c->in, c->in.len + BUFSIZ) == MEM_ERROR)
+    {
+      c->gone = 1;
+      return;
+    }
+
+    n = read(c->fd, c->in.chars + c->in.len, c->in.mem - c->in.len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n <= 0)
+    {
+      c->eof = 1;
+      /* a last command without its newline still runs */
+      if (c->in.len > 0 && c->in.chars[c->in.len - 1] != '\n')
+        append(&c->in, "\n", 1);
+    }
     else
+      c->in.len += n;
+  }
+}
+
+/* writes what it can of the replies, c->lock held */
+void client_flush(struct client *c)
+{
+  ssize_t w;
+  int done = 0;
+
+  while (done < c->reply.len)
+  {
+    w = send(c->fd, c->reply.chars + done, c->reply.len - done, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (w < 0)
     {
-      append(&buf, &c, 1);
-      parn = 0;
+      c->gone = 1;
+      c->reply.len = 0;
+      return;
     }
+    done += w;
   }
 
-  return 0;
+  memmove(c->reply.chars, c->reply.chars + done, c->reply.len - done);
+  c->reply.len -= done;
+}
+
+void client_free(struct client *c)
+{
+  if (c->before != NULL)
+    c->before->after = c->after;
+  else
+    N.all = c->after;
+  if (c->after != NULL)
+    c->after->before = c->before;
+
+  if (c->doc != NULL) doc_detach(c->doc);
+  close(c->fd);
+  pthread_mutex_destroy(&c->lock);
+  free(c->in.chars);
+  free(c->reply.chars);
+  free(c);
+}
+
+void client_event(struct client *c, int events)
+{
+  int drop = 0;
+
+  pthread_mutex_lock(&c->lock);
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    client_read(c);
+  if (c->reply.len > 0)
+    client_flush(c);
+
+  if (!c->queued)
+  {
+    if ((!c->gone && has_line(c)) || ((c->eof || c->gone) && c->doc != NULL))
+      enqueue(c);
+    else if ((c->eof || c->gone) && c->reply.len == 0)
+      drop = 1;
+  }
+
+  if (!drop) client_arm(c, 0);
+  pthread_mutex_unlock(&c->lock);
+
+  if (drop) client_free(c);
+}
+
+void server_accept()
+{
+  struct epoll_event ev;
+  struct client *c;
+  int fd;
+
+  while ((fd = accept4(N.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    c = (struct client*)calloc(1, sizeof(struct client));
+    if (c == NULL || (c->doc = doc_new(NULL)) == NULL)
+    {
+      free(c);
+      close(fd);
+      continue;
+    }
+
+    c->doc->users = 1;
+    c->fd = fd;
+    pthread_mutex_init(&c->lock, NULL);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = c;
+    if (epoll_ctl(N.epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+      doc_free(c->doc);
+      pthread_mutex_destroy(&c->lock);
+      free(c);
+      close(fd);
+      continue;
+    }
+
+    c->after = N.all;
+    if (N.all != NULL) N.all->before = c;
+    N.all = c;
+  }
+}
+
+/* binds path, taking it over from a server that is no longer there */
+int server_bind(char *path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  int probe;
+  int res;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (bind(N.fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) return 0;
+  if (errno != EADDRINUSE || stat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) return -1;
+
+  probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe < 0) return -1;
+  res = connect(probe, (struct sockaddr*)&addr, sizeof(addr));
+  close(probe);
+  if (res == 0 || errno != ECONNREFUSED)
+  {
+    errno = EADDRINUSE;
+    return -1;
+  }
+
+  unlink(path);
+  return bind(N.fd, (struct sockaddr*)&addr, sizeof(addr));
 }
 
+/* runs until SIGINT or SIGTERM; hosted documents that were not saved are
+   reported on the way out. Exits with 2 when the socket can't be set up */
+int run_server(char *path)
+{
+  struct epoll_event ev[64];
+  pthread_t th[WORKERS];
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  int started;
+  int m;
+  int k;
+
+  /* one worker per CPU, at least two so a slow command does not hold up
+     every other document */
+  if (n > WORKERS) n = WORKERS;
+  if (n < 2) n = 2;
+
+  N.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (N.fd < 0 || server_bind(path) < 0 || listen(N.fd, SOMAXCONN) < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if (N.fd >= 0) close(N.fd);
+    return 2;
+  }
+
+  N.epfd = epoll_create1(EPOLL_CLOEXEC);
+  ev[0].events = EPOLLIN;
+  ev[0].data.ptr = NULL;
+  if (N.epfd < 0 || epoll_ctl(N.epfd, EPOLL_CTL_ADD, N.fd, &ev[0]) < 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(N.fd);
+    unlink(path);
+    return 2;
+  }
+
+  for (started = 0; started < n; started++)
+    if (spawn_helper(&th[started], server_loop, NULL) != 0) break;
+
+  signal(SIGINT, stop_handler);
+  signal(SIGTERM, stop_handler);
+
+  while (!quit && started > 0)
+  {
+    m = epoll_wait(N.epfd, ev, 64, -1);
+    if (m < 0 && errno != EINTR) break;
+
+    for (k = 0; k < m; k++)
+    {
+      if (ev[k].data.ptr == NULL)
+        server_accept();
+      else
+        client_event((struct client*)ev[k].data.ptr, ev[k].events);
+    }
+  }
+
+  close(N.fd);
+  unlink(path);
+
+  pthread_mutex_lock(&N.lock);
+  N.stop = 1;
+  pthread_cond_broadcast(&N.cond);
+  pthread_mutex_unlock(&N.lock);
+  for (k = 0; k < started; k++)
+    pthread_join(th[k], NULL);
+
+  while (N.all != NULL)
+    client_free(N.all);
+
+  for (k = 0; k < N.ndocs; k++)
+  {
+    fprintf(stderr, "%s: progress wasn`t saved\n", N.docs[k]->key);
+    doc_free(N.docs[k]);
+  }
+  free(N.docs);
+  close(N.epfd);
+
+  return started > 0 ? 0 : 2;
+}